@@ -14,6 +14,7 @@
 #include <linux/printk.h>
 #include <linux/init.h>
 #include <linux/usb.h>
+#include <linux/usb/hcd.h>
 #include <linux/i2c.h>
 #include <linux/component.h>
 #include <linux/regmap.h>
@@ -21,7 +22,9 @@
 #include <linux/dma-buf.h>
 #include <linux/dma-mapping.h>
 #include <linux/time.h>
+#include <linux/hrtimer.h>
 #include <linux/device.h>
+#include <linux/debugfs.h>
 #include <drm/drm_gem.h>
 #include <drm/drm_prime.h>
 #include <drm/drm_vblank.h>
@@ -33,17 +36,26 @@
 #include <drm/drm_fbdev_generic.h>
 #include <drm/drm_gem_framebuffer_helper.h>
 #include <drm/drm_gem_dma_helper.h>
+#include <drm/drm_gem_shmem_helper.h>
+#include <drm/drm_gem_atomic_helper.h>
 #include <drm/drm_atomic_helper.h>
 #include <drm/drm_simple_kms_helper.h>
 #include <drm/drm_crtc_helper.h>
 #include <drm/drm_probe_helper.h>
 #include <drm/drm_damage_helper.h>
+#include <drm/drm_blend.h>
 #include <drm/drm_fb_dma_helper.h>
 
 #include "fl2000_registers.h"
 
 #define UNUSED(x) ((void)(x))
 
+/* Frame buffer layout FL2000 transmits as is: RGB565 or RGB888 matching the mode, lines packed
+ * without gaps, 32-bit halves of every 64-bit word swapped and frame padded to 64 bits. Frame
+ * buffer covers the whole mode. Driver private, vendor is not registered
+ */
+#define DRM_FORMAT_MOD_FL2000_WIRE fourcc_mod_code(NONE, 0xf12000)
+
 /* Known USB interfaces of FL2000 */
 enum fl2000_interface {
 	FL2000_USBIF_AVCONTROL = 0,
@@ -144,18 +156,95 @@ struct fl2000_pll {
 struct fl2000_stream;
 struct fl2000_stream *fl2000_stream_create(struct usb_device *usb_dev, struct drm_crtc *crtc);
 void fl2000_stream_destroy(struct usb_device *usb_dev);
+void fl2000_stream_debugfs_init(struct fl2000_stream *stream, struct dentry *root);
+
+/* Planes composed into the frame: primary, overlay and cursor */
+#define FL2000_PLANE_NUM 3
+
+/* Damaged regions converted in one frame, e.g. old and new cursor position */
+#define FL2000_CLIP_NUM 4
+
+/* Plane to be converted into the frame, planes are stacked in the order they are given. Planes
+ * with alpha are blended over the ones below
+ */
+struct fl2000_plane {
+	const struct drm_format_info *format;
+	u64 modifier;
+	const void *vaddr[DRM_FORMAT_MAX_PLANES]; /* Color planes of the frame buffer */
+	unsigned int pitch[DRM_FORMAT_MAX_PLANES];
+	struct drm_rect dst; /* Position on the frame */
+	struct drm_rect src; /* Source rectangle in the frame buffer, 16.16 fixed point */
+	unsigned int rotation; /* DRM_MODE_ROTATE_* and DRM_MODE_REFLECT_* */
+	bool scaled; /* Source rectangle is stretched over the position */
+	enum drm_scaling_filter scaling_filter;
+	enum drm_color_encoding color_encoding;
+	enum drm_color_range color_range;
+};
+
+static inline void fl2000_rect_union(struct drm_rect *r, const struct drm_rect *a)
+{
+	if (!drm_rect_visible(a))
+		return;
+
+	if (!drm_rect_visible(r)) {
+		*r = *a;
+		return;
+	}
+
+	r->x1 = min(r->x1, a->x1);
+	r->y1 = min(r->y1, a->y1);
+	r->x2 = max(r->x2, a->x2);
+	r->y2 = max(r->y2, a->y2);
+}
 
 /* Streaming interface */
-int fl2000_stream_mode_set(struct fl2000_stream *stream, int pixels, u32 bytes_pix);
-void fl2000_stream_compress(struct fl2000_stream *stream, void *src, unsigned int height,
-			    unsigned int width, unsigned int pitch);
+int fl2000_stream_reserve(struct fl2000_stream *stream, size_t size);
+void fl2000_stream_set_mirror(struct fl2000_stream *stream, bool mirror);
+int fl2000_stream_mode_set(struct fl2000_stream *stream, unsigned int width, unsigned int height,
+			   u32 bytes_pix);
+void fl2000_stream_compress(struct fl2000_stream *stream, const struct fl2000_plane *planes,
+			    unsigned int num_planes, const struct drm_rect *clips,
+			    unsigned int num_clips);
+void fl2000_stream_scanout(struct fl2000_stream *stream, struct page **pages,
+			   unsigned int nr_pages, size_t start, const struct drm_rect *rect);
 int fl2000_stream_enable(struct fl2000_stream *stream);
 void fl2000_stream_disable(struct fl2000_stream *stream);
 
+/* Pixel conversion kernels */
+typedef void (*fl2000_conv_line_t)(u8 *dbuf, unsigned int off, const u32 *sbuf, u32 pixels);
+
+struct fl2000_conv {
+	const char *name;
+	bool (*valid)(void);
+	void (*begin)(void);
+	void (*end)(void);
+	fl2000_conv_line_t to_rgb565;
+	fl2000_conv_line_t to_rgb888;
+};
+
+extern const struct fl2000_conv fl2000_conv_generic;
+extern const struct fl2000_conv fl2000_conv_swar;
+#ifdef CONFIG_X86_64
+extern const struct fl2000_conv fl2000_conv_ssse3;
+extern const struct fl2000_conv fl2000_conv_avx2;
+#endif
+
+int fl2000_conv_init(void);
+const struct fl2000_conv *fl2000_conv_get(u32 bytes_pix);
+void fl2000_conv_line(const struct fl2000_conv *conv, const struct fl2000_plane *plane,
+		      u32 bytes_pix, u8 *dbuf, unsigned int off, unsigned int x, unsigned int y,
+		      u32 pixels);
+void fl2000_conv_blend_line(const struct fl2000_conv *conv, const struct fl2000_plane *base,
+			    unsigned int bx, unsigned int by, const struct fl2000_plane *over,
+			    unsigned int ox, unsigned int oy, u32 bytes_pix, u8 *dbuf,
+			    unsigned int off, u32 pixels);
+void fl2000_conv_zero(u8 *dbuf, unsigned int off, size_t len);
+
 /* Interrupt polling task */
 struct fl2000_intr;
 struct fl2000_intr *fl2000_intr_create(struct usb_device *usb_dev, struct drm_device *drm);
 void fl2000_intr_destroy(struct usb_device *usb_dev);
+void fl2000_intr_sink_event(struct fl2000_intr *intr);
 
 /* I2C adapter interface creation */
 struct i2c_adapter *fl2000_i2c_init(struct usb_device *usb_dev);
@@ -169,10 +258,12 @@ int fl2000_usb_magic(struct usb_device *usb_dev);
 int fl2000_afe_magic(struct usb_device *usb_dev);
 int fl2000_set_transfers(struct usb_device *usb_dev);
 int fl2000_set_pixfmt(struct usb_device *usb_dev, u32 bytes_pix);
+int fl2000_set_mirror(struct usb_device *usb_dev, bool mirror);
 int fl2000_set_timings(struct usb_device *usb_dev, struct fl2000_timings *timings);
 int fl2000_set_pll(struct usb_device *usb_dev, struct fl2000_pll *pll);
 int fl2000_enable_interrupts(struct usb_device *usb_dev);
 int fl2000_check_interrupt(struct usb_device *usb_dev);
+int fl2000_get_frame_cnt(struct usb_device *usb_dev, u32 *frame_cnt);
 int fl2000_i2c_dword(struct usb_device *usb_dev, bool read, u16 addr, u8 offset, u32 *data);
 
 /* DRM device creation */
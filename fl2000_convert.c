@@ -0,0 +1,783 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Pixel conversion kernels. FL2000 expects 32-bit words swapped within each 64-bit word of the
+ * frame, so all kernels take byte offset of the first pixel in the destination buffer to place
+ * pixel bytes properly. Destination buffer is assumed to be at least 32-byte aligned (stream
+ * buffers are page-aligned). The fastest kernel is selected on module load by benchmarking all
+ * kernels supported by the CPU, similar to what lib/raid6 does.
+ *
+ * (C) Copyright 2017, Fresco Logic, Incorporated.
+ * (C) Copyright 2018-2020, Artem Mygaiev
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <asm/simd.h>
+#include <asm/unaligned.h>
+
+#include "fl2000.h"
+
+/* Benchmark each kernel on one 1080p line during 2^4 jiffies */
+#define FL2000_CONV_BENCH_PIXELS   1920
+#define FL2000_CONV_BENCH_TIME_LG2 4
+#define FL2000_CONV_MPIX(perf) \
+	(((perf) * FL2000_CONV_BENCH_PIXELS * HZ) >> (20 + FL2000_CONV_BENCH_TIME_LG2))
+
+/* Plane formats other than XRGB8888 are unpacked in chunks that fit on stack */
+#define FL2000_CONV_CHUNK 128
+
+static const struct fl2000_conv *fl2000_conv_rgb565;
+static const struct fl2000_conv *fl2000_conv_rgb888;
+
+static void fl2000_xrgb888_to_rgb888_generic(u8 *dbuf, unsigned int off, const u32 *sbuf,
+					     u32 pixels)
+{
+	for (unsigned int x = 0; x < pixels; x++) {
+		dbuf[off++ ^ 4] = (sbuf[x] & 0x000000FF) >> 0;
+		dbuf[off++ ^ 4] = (sbuf[x] & 0x0000FF00) >> 8;
+		dbuf[off++ ^ 4] = (sbuf[x] & 0x00FF0000) >> 16;
+	}
+}
+
+static void fl2000_xrgb888_to_rgb565_generic(u8 *dbuf, unsigned int off, const u32 *sbuf,
+					     u32 pixels)
+{
+	u16 *dbuf16 = (u16 *)dbuf;
+
+	off /= 2;
+	for (unsigned int x = 0; x < pixels; x++) {
+		u16 val565 = ((sbuf[x] & 0x00F80000) >> 8) | ((sbuf[x] & 0x0000FC00) >> 5) |
+			     ((sbuf[x] & 0x000000F8) >> 3);
+		dbuf16[(off + x) ^ 2] = val565;
+	}
+}
+
+const struct fl2000_conv fl2000_conv_generic = {
+	.name = "generic",
+	.to_rgb565 = fl2000_xrgb888_to_rgb565_generic,
+	.to_rgb888 = fl2000_xrgb888_to_rgb888_generic,
+};
+
+/* 64-bit SWAR kernels: 8 pixels packed into 3 words for RGB888, 4 pixels into 1 word for RGB565,
+ * then word halves swapped with a single rotation. Unaligned head and tail use generic kernels
+ */
+static void fl2000_xrgb888_to_rgb888_swar(u8 *dbuf, unsigned int off, const u32 *sbuf,
+					  u32 pixels)
+{
+	unsigned int head = 0;
+
+	while (head < pixels && !IS_ALIGNED(off + head * 3, sizeof(u64)))
+		head++;
+	fl2000_xrgb888_to_rgb888_generic(dbuf, off, sbuf, head);
+	off += head * 3;
+	sbuf += head;
+	pixels -= head;
+
+	for (; pixels >= 8; pixels -= 8, sbuf += 8, off += 24) {
+		__le64 *d = (__le64 *)(dbuf + off);
+		u64 p0 = sbuf[0] & 0xFFFFFF, p1 = sbuf[1] & 0xFFFFFF;
+		u64 p2 = sbuf[2] & 0xFFFFFF, p3 = sbuf[3] & 0xFFFFFF;
+		u64 p4 = sbuf[4] & 0xFFFFFF, p5 = sbuf[5] & 0xFFFFFF;
+		u64 p6 = sbuf[6] & 0xFFFFFF, p7 = sbuf[7] & 0xFFFFFF;
+
+		d[0] = cpu_to_le64(ror64(p0 | p1 << 24 | p2 << 48, 32));
+		d[1] = cpu_to_le64(ror64(p2 >> 16 | p3 << 8 | p4 << 32 | p5 << 56, 32));
+		d[2] = cpu_to_le64(ror64(p5 >> 8 | p6 << 16 | p7 << 40, 32));
+	}
+
+	fl2000_xrgb888_to_rgb888_generic(dbuf, off, sbuf, pixels);
+}
+
+static inline u64 fl2000_xrgb888_to_rgb565_x2(const u32 *sbuf)
+{
+	u64 v = (u64)sbuf[1] << 32 | sbuf[0];
+
+	v = ((v >> 8) & 0x0000F8000000F800ULL) | ((v >> 5) & 0x000007E0000007E0ULL) |
+	    ((v >> 3) & 0x0000001F0000001FULL);
+
+	return (v | v >> 16) & 0xFFFFFFFF;
+}
+
+static void fl2000_xrgb888_to_rgb565_swar(u8 *dbuf, unsigned int off, const u32 *sbuf,
+					  u32 pixels)
+{
+	unsigned int head = 0;
+
+	while (head < pixels && !IS_ALIGNED(off + head * 2, sizeof(u64)))
+		head++;
+	fl2000_xrgb888_to_rgb565_generic(dbuf, off, sbuf, head);
+	off += head * 2;
+	sbuf += head;
+	pixels -= head;
+
+	for (; pixels >= 4; pixels -= 4, sbuf += 4, off += 8) {
+		__le64 *d = (__le64 *)(dbuf + off);
+
+		/* Swapped halves: pixels 2 and 3 go first */
+		*d = cpu_to_le64(fl2000_xrgb888_to_rgb565_x2(sbuf + 2) |
+				 fl2000_xrgb888_to_rgb565_x2(sbuf) << 32);
+	}
+
+	fl2000_xrgb888_to_rgb565_generic(dbuf, off, sbuf, pixels);
+}
+
+const struct fl2000_conv fl2000_conv_swar = {
+	.name = "swar64",
+	.to_rgb565 = fl2000_xrgb888_to_rgb565_swar,
+	.to_rgb888 = fl2000_xrgb888_to_rgb888_swar,
+};
+
+static const struct fl2000_conv *const fl2000_conv_algos[] = {
+#ifdef CONFIG_X86_64
+	&fl2000_conv_avx2,
+	&fl2000_conv_ssse3,
+#endif
+	&fl2000_conv_swar,
+	&fl2000_conv_generic,
+};
+
+/**
+ * fl2000_conv_get() - get conversion kernel for the wire format
+ * @bytes_pix:	bytes per pixel on the wire
+ *
+ * SIMD kernels cannot be used in every context, so portable SWAR kernel is returned if SIMD
+ * registers are not usable at the moment
+ *
+ * Return: Conversion kernel
+ */
+const struct fl2000_conv *fl2000_conv_get(u32 bytes_pix)
+{
+	const struct fl2000_conv *conv = (bytes_pix == 2) ? fl2000_conv_rgb565 : fl2000_conv_rgb888;
+
+	if (conv->begin && !may_use_simd())
+		return &fl2000_conv_swar;
+
+	return conv;
+}
+
+/* Source already has the wire format: bytes are copied with 32-bit halves of each 64-bit word
+ * swapped, no pixel unpacking needed
+ */
+static void fl2000_swizzle(u8 *dbuf, unsigned int off, const u8 *sbuf, size_t len)
+{
+	for (; len && !IS_ALIGNED(off, sizeof(u64)); len--)
+		dbuf[off++ ^ 4] = *sbuf++;
+
+	for (; len >= sizeof(u64); len -= sizeof(u64), sbuf += sizeof(u64), off += sizeof(u64))
+		*(u64 *)(dbuf + off) = ror64(get_unaligned((const u64 *)sbuf), 32);
+
+	for (; len; len--)
+		dbuf[off++ ^ 4] = *sbuf++;
+}
+
+/* YCbCr to RGB matrix in 16.16 fixed point, indexed by encoding (BT.601, BT.709) and range
+ * (limited, full)
+ */
+struct fl2000_yuv_coef {
+	s32 y_off;
+	s32 y;
+	s32 rv;
+	s32 gu;
+	s32 gv;
+	s32 bu;
+};
+
+static const struct fl2000_yuv_coef fl2000_yuv_coefs[2][2] = {
+	{
+		{ 16, 76309, 104597, 25675, 53279, 132201 },
+		{ 0, 65536, 91881, 22553, 46802, 116130 },
+	},
+	{
+		{ 16, 76309, 117489, 13975, 34925, 138438 },
+		{ 0, 65536, 103206, 12276, 30679, 121609 },
+	},
+};
+
+static inline u32 fl2000_yuv_to_xrgb888(const struct fl2000_yuv_coef *c, int y, int u, int v)
+{
+	s32 luma = (y - c->y_off) * c->y + (1 << 15);
+	s32 r = (luma + c->rv * v) >> 16;
+	s32 g = (luma - c->gu * u - c->gv * v) >> 16;
+	s32 b = (luma + c->bu * u) >> 16;
+
+	return clamp(r, 0, 255) << 16 | clamp(g, 0, 255) << 8 | clamp(b, 0, 255);
+}
+
+/* Frame buffer in wire format has the layout of the frame, both are swizzled the same way */
+static void fl2000_copy_wire(u8 *dbuf, unsigned int off, const u8 *sbuf, size_t len)
+{
+	sbuf -= off;
+
+	for (; len && !IS_ALIGNED(off, sizeof(u64)); len--, off++)
+		dbuf[off ^ 4] = sbuf[off ^ 4];
+
+	memcpy(dbuf + off, sbuf + off, ALIGN_DOWN(len, sizeof(u64)));
+	off += ALIGN_DOWN(len, sizeof(u64));
+	len %= sizeof(u64);
+
+	for (; len; len--, off++)
+		dbuf[off ^ 4] = sbuf[off ^ 4];
+}
+
+/* Chroma is shared by pairs of pixels, the pair is found from even column of the pixel */
+static void fl2000_unpack_yuv(const struct fl2000_plane *plane, u32 *dbuf, unsigned int x,
+			      unsigned int y, u32 pixels)
+{
+	const struct fl2000_yuv_coef *c =
+		&fl2000_yuv_coefs[plane->color_encoding == DRM_COLOR_YCBCR_BT709]
+				 [plane->color_range == DRM_COLOR_YCBCR_FULL_RANGE];
+	const u8 *luma = plane->vaddr[0] + y * plane->pitch[0];
+	const u8 *chroma;
+
+	switch (plane->format->format) {
+	case DRM_FORMAT_NV12:
+		chroma = plane->vaddr[1] + (y / 2) * plane->pitch[1];
+		for (unsigned int i = 0; i < pixels; i++, x++)
+			dbuf[i] = fl2000_yuv_to_xrgb888(c, luma[x], chroma[x & ~1U] - 128,
+							chroma[x | 1] - 128);
+		break;
+	case DRM_FORMAT_YUYV:
+		/* Y0 U Y1 V */
+		for (unsigned int i = 0; i < pixels; i++, x++) {
+			const u8 *pair = luma + (x & ~1U) * 2;
+
+			dbuf[i] = fl2000_yuv_to_xrgb888(c, luma[x * 2], pair[1] - 128,
+							pair[3] - 128);
+		}
+		break;
+	}
+}
+
+/* Replicate high bits into low ones, so that full intensity stays full */
+static inline u32 fl2000_rgb565_to_xrgb888(u16 val)
+{
+	u32 r = (val >> 11) & 0x1F;
+	u32 g = (val >> 5) & 0x3F;
+	u32 b = val & 0x1F;
+
+	return (r << 3 | r >> 2) << 16 | (g << 2 | g >> 4) << 8 | (b << 3 | b >> 2);
+}
+
+/* Frame buffer in wire format is read back only when another plane is blended over it */
+static void fl2000_unpack_wire(const struct fl2000_plane *plane, u32 *dbuf, unsigned int x,
+			       unsigned int y, u32 pixels)
+{
+	const u8 *sbuf = plane->vaddr[0];
+	unsigned int cpp = plane->format->cpp[0];
+	unsigned int off = y * plane->pitch[0] + x * cpp;
+
+	for (unsigned int i = 0; i < pixels; i++, off += cpp) {
+		if (cpp == 2)
+			dbuf[i] = fl2000_rgb565_to_xrgb888(sbuf[off ^ 4] |
+							   sbuf[(off + 1) ^ 4] << 8);
+		else
+			dbuf[i] = sbuf[off ^ 4] | sbuf[(off + 1) ^ 4] << 8 |
+				  sbuf[(off + 2) ^ 4] << 16;
+	}
+}
+
+static void fl2000_unpack(const struct fl2000_plane *plane, u32 *dbuf, unsigned int x,
+			  unsigned int y, u32 pixels)
+{
+	const u8 *sbuf = plane->vaddr[0] + y * plane->pitch[0] + x * plane->format->cpp[0];
+	const u16 *sbuf16 = (const u16 *)sbuf;
+	const u32 *sbuf32 = (const u32 *)sbuf;
+
+	if (plane->modifier == DRM_FORMAT_MOD_FL2000_WIRE) {
+		fl2000_unpack_wire(plane, dbuf, x, y, pixels);
+		return;
+	}
+
+	switch (plane->format->format) {
+	case DRM_FORMAT_XRGB8888:
+		memcpy(dbuf, sbuf32, pixels * sizeof(u32));
+		break;
+	case DRM_FORMAT_RGB565:
+		for (unsigned int i = 0; i < pixels; i++)
+			dbuf[i] = fl2000_rgb565_to_xrgb888(sbuf16[i]);
+		break;
+	case DRM_FORMAT_RGB888:
+		for (unsigned int i = 0; i < pixels; i++, sbuf += 3)
+			dbuf[i] = sbuf[0] | sbuf[1] << 8 | sbuf[2] << 16;
+		break;
+	case DRM_FORMAT_BGR888:
+		for (unsigned int i = 0; i < pixels; i++, sbuf += 3)
+			dbuf[i] = sbuf[2] | sbuf[1] << 8 | sbuf[0] << 16;
+		break;
+	case DRM_FORMAT_XBGR8888:
+		for (unsigned int i = 0; i < pixels; i++)
+			dbuf[i] = (sbuf32[i] & 0x0000FF00) | (sbuf32[i] & 0x000000FF) << 16 |
+				  (sbuf32[i] & 0x00FF0000) >> 16;
+		break;
+	case DRM_FORMAT_NV12:
+	case DRM_FORMAT_YUYV:
+		fl2000_unpack_yuv(plane, dbuf, x, y, pixels);
+		break;
+	default:
+		memset(dbuf, 0, pixels * sizeof(u32));
+		break;
+	}
+}
+
+/* Walk over frame buffer pixels shown along a frame line: position of the first one and step to
+ * the next one. Position is in pixels, or in 16.16 fixed point (pixel centers) for scaled planes
+ */
+struct fl2000_walk {
+	int x;
+	int y;
+	int step_x;
+	int step_y;
+};
+
+/* Rotated or reflected line is gathered pixel by pixel, 32-bit RGB directly and other formats
+ * through the regular unpacking
+ */
+static void fl2000_unpack_rotated(const struct fl2000_plane *plane, u32 *dbuf,
+				  const struct fl2000_walk *walk, u32 pixels)
+{
+	unsigned int x = walk->x;
+	unsigned int y = walk->y;
+
+	if (plane->format->format == DRM_FORMAT_XRGB8888 ||
+	    plane->format->format == DRM_FORMAT_ARGB8888) {
+		const u8 *sbuf = plane->vaddr[0] + y * plane->pitch[0] + x * sizeof(u32);
+		ssize_t stride = walk->step_y * (ssize_t)plane->pitch[0] +
+				 walk->step_x * (ssize_t)sizeof(u32);
+
+		for (unsigned int i = 0; i < pixels; i++, sbuf += stride)
+			dbuf[i] = *(const u32 *)sbuf;
+		return;
+	}
+
+	for (unsigned int i = 0; i < pixels; i++, x += walk->step_x, y += walk->step_y)
+		fl2000_unpack(plane, &dbuf[i], x, y, 1);
+}
+
+static inline u32 fl2000_fetch(const struct fl2000_plane *plane, int x, int y)
+{
+	u32 val;
+
+	if (plane->format->format == DRM_FORMAT_XRGB8888)
+		return *(const u32 *)(plane->vaddr[0] + y * plane->pitch[0] + x * sizeof(u32));
+
+	fl2000_unpack(plane, &val, x, y, 1);
+	return val;
+}
+
+/* Interpolate between XRGB8888 pixels, weight of the second one is w/256 */
+static inline u32 fl2000_lerp(u32 a, u32 b, u32 w)
+{
+	u32 rb = (((a & 0xFF00FF) * (256 - w) + (b & 0xFF00FF) * w) >> 8) & 0xFF00FF;
+	u32 g = (((a & 0x00FF00) * (256 - w) + (b & 0x00FF00) * w) >> 8) & 0x00FF00;
+
+	return rb | g;
+}
+
+/* Scaled line is sampled at pixel centers, either from the nearest pixel or from four pixels
+ * around. Samples never leave the source rectangle, edges are repeated
+ */
+static void fl2000_unpack_scaled(const struct fl2000_plane *plane, u32 *dbuf,
+				 const struct fl2000_walk *walk, u32 pixels)
+{
+	int x_min = plane->src.x1 >> 16;
+	int y_min = plane->src.y1 >> 16;
+	int x_max = (plane->src.x2 - 1) >> 16;
+	int y_max = (plane->src.y2 - 1) >> 16;
+	int x = walk->x;
+	int y = walk->y;
+
+	for (unsigned int i = 0; i < pixels; i++, x += walk->step_x, y += walk->step_y) {
+		int x0, y0, x1, y1;
+		u32 top, bottom;
+
+		if (plane->scaling_filter == DRM_SCALING_FILTER_NEAREST_NEIGHBOR) {
+			dbuf[i] = fl2000_fetch(plane, clamp(x >> 16, x_min, x_max),
+					       clamp(y >> 16, y_min, y_max));
+			continue;
+		}
+
+		/* Pixel to the left and above the sample point is the first of four */
+		x0 = (x - 0x8000) >> 16;
+		y0 = (y - 0x8000) >> 16;
+		x1 = clamp(x0 + 1, x_min, x_max);
+		y1 = clamp(y0 + 1, y_min, y_max);
+		x0 = clamp(x0, x_min, x_max);
+		y0 = clamp(y0, y_min, y_max);
+
+		top = fl2000_lerp(fl2000_fetch(plane, x0, y0), fl2000_fetch(plane, x1, y0),
+				  ((x - 0x8000) & 0xFFFF) >> 8);
+		bottom = fl2000_lerp(fl2000_fetch(plane, x0, y1), fl2000_fetch(plane, x1, y1),
+				     ((x - 0x8000) & 0xFFFF) >> 8);
+		dbuf[i] = fl2000_lerp(top, bottom, ((y - 0x8000) & 0xFFFF) >> 8);
+	}
+}
+
+/* Scaled plane position is mapped to the source rectangle with pixel centers matching, then the
+ * same way as one that is not scaled
+ */
+static void fl2000_plane_src_scaled(const struct fl2000_plane *plane, unsigned int dx,
+				    unsigned int dy, struct fl2000_walk *walk)
+{
+	int sw = drm_rect_width(&plane->src);
+	int sh = drm_rect_height(&plane->src);
+	bool rotated = drm_rotation_90_or_270(plane->rotation);
+	int su = (rotated ? sh : sw) / drm_rect_width(&plane->dst);
+	int sv = (rotated ? sw : sh) / drm_rect_height(&plane->dst);
+	int u = dx * su + su / 2;
+	int v = dy * sv + sv / 2;
+
+	switch (plane->rotation & DRM_MODE_ROTATE_MASK) {
+	case DRM_MODE_ROTATE_90:
+		walk->x = sw - v;
+		walk->y = u;
+		walk->step_x = 0;
+		walk->step_y = su;
+		break;
+	case DRM_MODE_ROTATE_180:
+		walk->x = sw - u;
+		walk->y = sh - v;
+		walk->step_x = -su;
+		walk->step_y = 0;
+		break;
+	case DRM_MODE_ROTATE_270:
+		walk->x = v;
+		walk->y = sh - u;
+		walk->step_x = 0;
+		walk->step_y = -su;
+		break;
+	default:
+		walk->x = u;
+		walk->y = v;
+		walk->step_x = su;
+		walk->step_y = 0;
+		break;
+	}
+
+	if (plane->rotation & DRM_MODE_REFLECT_X) {
+		walk->x = sw - walk->x;
+		walk->step_x = -walk->step_x;
+	}
+	if (plane->rotation & DRM_MODE_REFLECT_Y) {
+		walk->y = sh - walk->y;
+		walk->step_y = -walk->step_y;
+	}
+
+	walk->x += plane->src.x1;
+	walk->y += plane->src.y1;
+}
+
+/* Find frame buffer pixel shown at the given pixel of the plane position, and the step to the
+ * pixel shown next to it on the line. Rotation is counter-clockwise and is applied after
+ * reflection, as in drm_rect_rotate()
+ */
+static void fl2000_plane_src(const struct fl2000_plane *plane, unsigned int dx, unsigned int dy,
+			     struct fl2000_walk *walk)
+{
+	int w = drm_rect_width(&plane->dst);
+	int h = drm_rect_height(&plane->dst);
+	int sw = w;
+	int sh = h;
+
+	if (plane->scaled) {
+		fl2000_plane_src_scaled(plane, dx, dy, walk);
+		return;
+	}
+
+	switch (plane->rotation & DRM_MODE_ROTATE_MASK) {
+	case DRM_MODE_ROTATE_90:
+		walk->x = h - 1 - dy;
+		walk->y = dx;
+		walk->step_x = 0;
+		walk->step_y = 1;
+		swap(sw, sh);
+		break;
+	case DRM_MODE_ROTATE_180:
+		walk->x = w - 1 - dx;
+		walk->y = h - 1 - dy;
+		walk->step_x = -1;
+		walk->step_y = 0;
+		break;
+	case DRM_MODE_ROTATE_270:
+		walk->x = dy;
+		walk->y = w - 1 - dx;
+		walk->step_x = 0;
+		walk->step_y = -1;
+		swap(sw, sh);
+		break;
+	default:
+		walk->x = dx;
+		walk->y = dy;
+		walk->step_x = 1;
+		walk->step_y = 0;
+		break;
+	}
+
+	if (plane->rotation & DRM_MODE_REFLECT_X) {
+		walk->x = sw - 1 - walk->x;
+		walk->step_x = -walk->step_x;
+	}
+	if (plane->rotation & DRM_MODE_REFLECT_Y) {
+		walk->y = sh - 1 - walk->y;
+		walk->step_y = -walk->step_y;
+	}
+
+	walk->x += plane->src.x1 >> 16;
+	walk->y += plane->src.y1 >> 16;
+}
+
+/* Unpack pixels along the walk and advance it */
+static void fl2000_walk_unpack(const struct fl2000_plane *plane, struct fl2000_walk *walk,
+			       u32 *dbuf, u32 pixels)
+{
+	if (plane->scaled)
+		fl2000_unpack_scaled(plane, dbuf, walk, pixels);
+	else if (walk->step_x != 1)
+		fl2000_unpack_rotated(plane, dbuf, walk, pixels);
+	else
+		fl2000_unpack(plane, dbuf, walk->x, walk->y, pixels);
+
+	walk->x += pixels * walk->step_x;
+	walk->y += pixels * walk->step_y;
+}
+
+/**
+ * fl2000_conv_line() - convert one line segment of a plane to the wire format
+ * @conv:	conversion kernels, see fl2000_conv_get()
+ * @plane:	plane to convert
+ * @bytes_pix:	bytes per pixel on the wire
+ * @dbuf:	stream buffer
+ * @off:	byte offset of the first pixel in the stream buffer
+ * @x:		column of the first pixel, relative to the plane position on the frame
+ * @y:		line, relative to the plane position on the frame
+ * @pixels:	number of pixels
+ *
+ * XRGB8888 goes directly to the selected kernel. Source that matches the wire format is only
+ * swizzled, other formats (including YUV) are unpacked to XRGB8888 in chunks and then converted
+ * by the kernel, so every source pixel is read and every wire pixel is written once. Rotated,
+ * reflected and scaled planes are gathered in chunks as well, so they cost no extra pass
+ */
+void fl2000_conv_line(const struct fl2000_conv *conv, const struct fl2000_plane *plane,
+		      u32 bytes_pix, u8 *dbuf, unsigned int off, unsigned int x, unsigned int y,
+		      u32 pixels)
+{
+	fl2000_conv_line_t line = (bytes_pix == 2) ? conv->to_rgb565 : conv->to_rgb888;
+	u32 chunk[FL2000_CONV_CHUNK] __aligned(32);
+	struct fl2000_walk walk;
+	const u8 *sbuf;
+
+	fl2000_plane_src(plane, x, y, &walk);
+	if (plane->scaled || walk.step_x != 1)
+		goto unpack;
+
+	sbuf = plane->vaddr[0] + walk.y * plane->pitch[0] + walk.x * plane->format->cpp[0];
+	if (plane->modifier == DRM_FORMAT_MOD_FL2000_WIRE) {
+		fl2000_copy_wire(dbuf, off, sbuf, pixels * bytes_pix);
+		return;
+	}
+
+	switch (plane->format->format) {
+	case DRM_FORMAT_XRGB8888:
+		line(dbuf, off, (const u32 *)sbuf, pixels);
+		return;
+	case DRM_FORMAT_RGB565:
+		if (bytes_pix == 2) {
+			fl2000_swizzle(dbuf, off, sbuf, pixels * 2);
+			return;
+		}
+		break;
+	case DRM_FORMAT_RGB888:
+		if (bytes_pix == 3) {
+			fl2000_swizzle(dbuf, off, sbuf, pixels * 3);
+			return;
+		}
+		break;
+	}
+
+unpack:
+	while (pixels) {
+		u32 n = min_t(u32, pixels, FL2000_CONV_CHUNK);
+
+		fl2000_walk_unpack(plane, &walk, chunk, n);
+		line(dbuf, off, chunk, n);
+		off += n * bytes_pix;
+		pixels -= n;
+	}
+}
+
+/* Blend premultiplied ARGB8888 over XRGB8888: d = s + d * (1 - alpha). Division by 255 is done
+ * exactly with a multiply and shifts. Source is walked with a stride, so it may be reflected
+ */
+static void fl2000_blend(u32 *dbuf, const u32 *sbuf, ssize_t stride, u32 pixels)
+{
+	for (unsigned int i = 0; i < pixels; i++, sbuf += stride) {
+		u32 s = *sbuf;
+		u32 inv = 255 - (s >> 24);
+		u32 d = 0;
+
+		if (!inv) {
+			dbuf[i] = s;
+			continue;
+		}
+
+		for (unsigned int shift = 0; shift < 24; shift += 8) {
+			u32 c = ((dbuf[i] >> shift) & 0xFF) * inv + 128;
+
+			c = (c + (c >> 8)) >> 8;
+			d |= min_t(u32, ((s >> shift) & 0xFF) + c, 255) << shift;
+		}
+		dbuf[i] = d;
+	}
+}
+
+/**
+ * fl2000_conv_blend_line() - convert one line segment of a plane blended over another one
+ * @conv:	conversion kernels, see fl2000_conv_get()
+ * @base:	plane underneath, NULL if there is none (black)
+ * @bx:		column of the first pixel, relative to the base plane position
+ * @by:		line, relative to the base plane position
+ * @over:	plane with premultiplied ARGB8888 pixels blended over the base, not scaled
+ * @ox:		column of the first pixel, relative to the blended plane position
+ * @oy:		line, relative to the blended plane position
+ * @bytes_pix:	bytes per pixel on the wire
+ * @dbuf:	stream buffer
+ * @off:	byte offset of the first pixel in the stream buffer
+ * @pixels:	number of pixels
+ *
+ * Base is unpacked to XRGB8888 in chunks, blended and then converted by the kernel, so blended
+ * segments are still written once
+ */
+void fl2000_conv_blend_line(const struct fl2000_conv *conv, const struct fl2000_plane *base,
+			    unsigned int bx, unsigned int by, const struct fl2000_plane *over,
+			    unsigned int ox, unsigned int oy, u32 bytes_pix, u8 *dbuf,
+			    unsigned int off, u32 pixels)
+{
+	fl2000_conv_line_t line = (bytes_pix == 2) ? conv->to_rgb565 : conv->to_rgb888;
+	u32 chunk[FL2000_CONV_CHUNK] __aligned(32);
+	struct fl2000_walk bwalk;
+	struct fl2000_walk owalk;
+	const u32 *sbuf;
+	ssize_t stride;
+
+	if (base)
+		fl2000_plane_src(base, bx, by, &bwalk);
+
+	fl2000_plane_src(over, ox, oy, &owalk);
+	sbuf = over->vaddr[0] + owalk.y * over->pitch[0] + owalk.x * sizeof(u32);
+	stride = owalk.step_y * (ssize_t)(over->pitch[0] / sizeof(u32)) + owalk.step_x;
+
+	while (pixels) {
+		u32 n = min_t(u32, pixels, FL2000_CONV_CHUNK);
+
+		if (base)
+			fl2000_walk_unpack(base, &bwalk, chunk, n);
+		else
+			memset(chunk, 0, n * sizeof(u32));
+		fl2000_blend(chunk, sbuf, stride, n);
+		line(dbuf, off, chunk, n);
+		sbuf += n * stride;
+		off += n * bytes_pix;
+		pixels -= n;
+	}
+}
+
+/**
+ * fl2000_conv_zero() - clear part of a frame line
+ * @dbuf:	stream buffer
+ * @off:	byte offset of the first byte in the stream buffer
+ * @len:	number of bytes
+ *
+ * Used for parts of the frame that no plane covers
+ */
+void fl2000_conv_zero(u8 *dbuf, unsigned int off, size_t len)
+{
+	for (; len && !IS_ALIGNED(off, sizeof(u64)); len--)
+		dbuf[off++ ^ 4] = 0;
+
+	memset(dbuf + off, 0, ALIGN_DOWN(len, sizeof(u64)));
+	off += ALIGN_DOWN(len, sizeof(u64));
+	len %= sizeof(u64);
+
+	for (; len; len--)
+		dbuf[off++ ^ 4] = 0;
+}
+
+static unsigned long fl2000_conv_bench(const struct fl2000_conv *conv, fl2000_conv_line_t line,
+				       u8 *dbuf, const u32 *sbuf)
+{
+	unsigned long perf = 0;
+	unsigned long j0, j1;
+
+	preempt_disable();
+	j0 = jiffies;
+	while ((j1 = jiffies) == j0)
+		cpu_relax();
+	while (time_before(jiffies, j1 + (1 << FL2000_CONV_BENCH_TIME_LG2))) {
+		if (conv->begin)
+			conv->begin();
+		line(dbuf, 0, sbuf, FL2000_CONV_BENCH_PIXELS);
+		if (conv->end)
+			conv->end();
+		perf++;
+	}
+	preempt_enable();
+
+	return perf;
+}
+
+/**
+ * fl2000_conv_init() - select the fastest conversion kernels
+ *
+ * Called once on module load. If benchmark cannot run, generic kernels are used
+ *
+ * Return: Operation result
+ */
+int fl2000_conv_init(void)
+{
+	unsigned long perf;
+	unsigned long best_rgb565 = 0;
+	unsigned long best_rgb888 = 0;
+	unsigned int dbuf_order = get_order(FL2000_CONV_BENCH_PIXELS * 3);
+	unsigned int sbuf_order = get_order(FL2000_CONV_BENCH_PIXELS * sizeof(u32));
+	u8 *dbuf;
+	u32 *sbuf;
+
+	fl2000_conv_rgb565 = &fl2000_conv_generic;
+	fl2000_conv_rgb888 = &fl2000_conv_generic;
+
+	dbuf = (u8 *)__get_free_pages(GFP_KERNEL, dbuf_order);
+	sbuf = (u32 *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, sbuf_order);
+	if (!dbuf || !sbuf) {
+		free_pages((unsigned long)dbuf, dbuf_order);
+		free_pages((unsigned long)sbuf, sbuf_order);
+		return -ENOMEM;
+	}
+
+	for (int i = 0; i < ARRAY_SIZE(fl2000_conv_algos); i++) {
+		const struct fl2000_conv *conv = fl2000_conv_algos[i];
+
+		if (conv->valid && !conv->valid())
+			continue;
+
+		perf = fl2000_conv_bench(conv, conv->to_rgb565, dbuf, sbuf);
+		if (perf > best_rgb565) {
+			best_rgb565 = perf;
+			fl2000_conv_rgb565 = conv;
+		}
+		pr_info("%-8s RGB565 %5lu MPix/s\n", conv->name, FL2000_CONV_MPIX(perf));
+
+		perf = fl2000_conv_bench(conv, conv->to_rgb888, dbuf, sbuf);
+		if (perf > best_rgb888) {
+			best_rgb888 = perf;
+			fl2000_conv_rgb888 = conv;
+		}
+		pr_info("%-8s RGB888 %5lu MPix/s\n", conv->name, FL2000_CONV_MPIX(perf));
+	}
+
+	pr_info("using %s for RGB565, %s for RGB888\n", fl2000_conv_rgb565->name,
+		fl2000_conv_rgb888->name);
+
+	free_pages((unsigned long)dbuf, dbuf_order);
+	free_pages((unsigned long)sbuf, sbuf_order);
+
+	return 0;
+}
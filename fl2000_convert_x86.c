@@ -0,0 +1,298 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * SSSE3 and AVX2 pixel conversion kernels. Pixels are packed and FL2000 word halves are swapped
+ * with byte shuffles, results are written with non-temporal stores so that stream buffers do not
+ * evict frame buffer data from CPU caches. As with lib/raid6 kernels, SIMD registers are assumed to
+ * be preserved between asm statements since kernel code is built without SIMD support.
+ *
+ * (C) Copyright 2018-2020, Artem Mygaiev
+ */
+
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+
+#include "fl2000.h"
+
+/* Shuffle masks pack 4 XRGB pixels of a register into 3 dwords d0..d2 and place them into output
+ * dword slots. For 16 pixels in registers A, B, C, D output is d1 d0 d3 d2 | d5 d4 d7 d6 |
+ * d9 d8 d11 d10, i.e. each output register is made of two shuffled input registers
+ */
+#define D0 0x00, 0x01, 0x02, 0x04
+#define D1 0x05, 0x06, 0x08, 0x09
+#define D2 0x0A, 0x0C, 0x0D, 0x0E
+#define ZZ 0x80, 0x80, 0x80, 0x80
+
+static const u8 fl2000_ssse3_rgb888_mask[6][16] __aligned(16) = {
+	{ D1, D0, ZZ, D2 }, /* A -> out0 */
+	{ ZZ, ZZ, D0, ZZ }, /* B -> out0 */
+	{ D2, D1, ZZ, ZZ }, /* B -> out1 */
+	{ ZZ, ZZ, D1, D0 }, /* C -> out1 */
+	{ ZZ, D2, ZZ, ZZ }, /* C -> out2 */
+	{ D0, ZZ, D2, D1 }, /* D -> out2 */
+};
+
+/* Same packing within each 128-bit lane, then dwords are permuted across lanes */
+static const u8 fl2000_avx2_rgb888_mask[32] __aligned(32) = { D0, D1, D2, ZZ, D0, D1, D2, ZZ };
+static const u32 fl2000_avx2_rgb888_perm[2][8] __aligned(32) = {
+	{ 1, 0, 4, 2, 6, 5, 7, 7 }, /* A: d1 d0 d3 d2 d5 d4 */
+	{ 4, 2, 6, 5, 0, 0, 1, 0 }, /* B: d9 d8 d11 d10, d7 d6 on top */
+};
+
+#undef D0
+#undef D1
+#undef D2
+#undef ZZ
+
+/* RGB565 is computed in dwords, then low words are gathered with halves of 64-bit words swapped */
+static const u32 fl2000_rgb565_mask[3][8] __aligned(32) = {
+	{ 0xF800, 0xF800, 0xF800, 0xF800, 0xF800, 0xF800, 0xF800, 0xF800 },
+	{ 0x07E0, 0x07E0, 0x07E0, 0x07E0, 0x07E0, 0x07E0, 0x07E0, 0x07E0 },
+	{ 0x001F, 0x001F, 0x001F, 0x001F, 0x001F, 0x001F, 0x001F, 0x001F },
+};
+
+static const u8 fl2000_ssse3_rgb565_shuf[2][16] __aligned(16) = {
+	{ 8, 9, 12, 13, 0, 1, 4, 5, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 8, 9, 12, 13, 0, 1, 4, 5 },
+};
+
+/* Convert unaligned head of the line with portable kernel, return number of pixels converted */
+static u32 fl2000_conv_head(fl2000_conv_line_t line, u8 *dbuf, unsigned int off,
+			    const u32 *sbuf, u32 pixels, u32 bytes_pix, unsigned int align)
+{
+	u32 head = 0;
+
+	while (head < pixels && !IS_ALIGNED(off + head * bytes_pix, align))
+		head++;
+	line(dbuf, off, sbuf, head);
+
+	return head;
+}
+
+static void fl2000_simd_begin(void)
+{
+	kernel_fpu_begin();
+}
+
+static void fl2000_simd_end(void)
+{
+	/* Non-temporal stores are weakly ordered, make them visible before buffer is submitted */
+	asm volatile("sfence" : : : "memory");
+	kernel_fpu_end();
+}
+
+static void fl2000_avx2_end(void)
+{
+	asm volatile("vzeroupper" : : : "memory");
+	fl2000_simd_end();
+}
+
+static bool fl2000_ssse3_valid(void)
+{
+	return boot_cpu_has(X86_FEATURE_SSSE3);
+}
+
+static bool fl2000_avx2_valid(void)
+{
+	return boot_cpu_has(X86_FEATURE_AVX2) && boot_cpu_has(X86_FEATURE_AVX);
+}
+
+static void fl2000_xrgb888_to_rgb888_ssse3(u8 *dbuf, unsigned int off, const u32 *sbuf,
+					   u32 pixels)
+{
+	u32 head = fl2000_conv_head(fl2000_conv_swar.to_rgb888, dbuf, off, sbuf, pixels, 3, 16);
+
+	off += head * 3;
+	sbuf += head;
+	pixels -= head;
+
+	asm volatile("movdqa %0, %%xmm8\n\t"
+		     "movdqa %1, %%xmm9\n\t"
+		     "movdqa %2, %%xmm10\n\t"
+		     "movdqa %3, %%xmm11\n\t"
+		     "movdqa %4, %%xmm12\n\t"
+		     "movdqa %5, %%xmm13\n\t"
+		     :
+		     : "m"(fl2000_ssse3_rgb888_mask[0]), "m"(fl2000_ssse3_rgb888_mask[1]),
+		       "m"(fl2000_ssse3_rgb888_mask[2]), "m"(fl2000_ssse3_rgb888_mask[3]),
+		       "m"(fl2000_ssse3_rgb888_mask[4]), "m"(fl2000_ssse3_rgb888_mask[5]));
+
+	for (; pixels >= 16; pixels -= 16, sbuf += 16, off += 48) {
+		asm volatile("movdqu 0x00(%0), %%xmm0\n\t"
+			     "movdqu 0x10(%0), %%xmm1\n\t"
+			     "movdqu 0x20(%0), %%xmm2\n\t"
+			     "movdqu 0x30(%0), %%xmm3\n\t"
+			     "movdqa %%xmm0, %%xmm4\n\t"
+			     "pshufb %%xmm8, %%xmm4\n\t"
+			     "movdqa %%xmm1, %%xmm5\n\t"
+			     "pshufb %%xmm9, %%xmm5\n\t"
+			     "por %%xmm5, %%xmm4\n\t"
+			     "movntdq %%xmm4, 0x00(%1)\n\t"
+			     "pshufb %%xmm10, %%xmm1\n\t"
+			     "movdqa %%xmm2, %%xmm5\n\t"
+			     "pshufb %%xmm11, %%xmm5\n\t"
+			     "por %%xmm5, %%xmm1\n\t"
+			     "movntdq %%xmm1, 0x10(%1)\n\t"
+			     "pshufb %%xmm12, %%xmm2\n\t"
+			     "pshufb %%xmm13, %%xmm3\n\t"
+			     "por %%xmm3, %%xmm2\n\t"
+			     "movntdq %%xmm2, 0x20(%1)\n\t"
+			     :
+			     : "r"(sbuf), "r"(dbuf + off)
+			     : "memory");
+	}
+
+	fl2000_conv_swar.to_rgb888(dbuf, off, sbuf, pixels);
+}
+
+static void fl2000_xrgb888_to_rgb565_ssse3(u8 *dbuf, unsigned int off, const u32 *sbuf,
+					   u32 pixels)
+{
+	u32 head = fl2000_conv_head(fl2000_conv_swar.to_rgb565, dbuf, off, sbuf, pixels, 2, 16);
+
+	off += head * 2;
+	sbuf += head;
+	pixels -= head;
+
+	asm volatile("movdqa %0, %%xmm8\n\t"
+		     "movdqa %1, %%xmm9\n\t"
+		     "movdqa %2, %%xmm10\n\t"
+		     "movdqa %3, %%xmm11\n\t"
+		     "movdqa %4, %%xmm12\n\t"
+		     :
+		     : "m"(fl2000_rgb565_mask[0]), "m"(fl2000_rgb565_mask[1]),
+		       "m"(fl2000_rgb565_mask[2]), "m"(fl2000_ssse3_rgb565_shuf[0]),
+		       "m"(fl2000_ssse3_rgb565_shuf[1]));
+
+	for (; pixels >= 8; pixels -= 8, sbuf += 8, off += 16) {
+		asm volatile("movdqu 0x00(%0), %%xmm0\n\t"
+			     "movdqu 0x10(%0), %%xmm1\n\t"
+			     "movdqa %%xmm0, %%xmm2\n\t"
+			     "psrld $8, %%xmm2\n\t"
+			     "pand %%xmm8, %%xmm2\n\t"
+			     "movdqa %%xmm0, %%xmm3\n\t"
+			     "psrld $5, %%xmm3\n\t"
+			     "pand %%xmm9, %%xmm3\n\t"
+			     "por %%xmm3, %%xmm2\n\t"
+			     "psrld $3, %%xmm0\n\t"
+			     "pand %%xmm10, %%xmm0\n\t"
+			     "por %%xmm2, %%xmm0\n\t"
+			     "pshufb %%xmm11, %%xmm0\n\t"
+			     "movdqa %%xmm1, %%xmm4\n\t"
+			     "psrld $8, %%xmm4\n\t"
+			     "pand %%xmm8, %%xmm4\n\t"
+			     "movdqa %%xmm1, %%xmm5\n\t"
+			     "psrld $5, %%xmm5\n\t"
+			     "pand %%xmm9, %%xmm5\n\t"
+			     "por %%xmm5, %%xmm4\n\t"
+			     "psrld $3, %%xmm1\n\t"
+			     "pand %%xmm10, %%xmm1\n\t"
+			     "por %%xmm4, %%xmm1\n\t"
+			     "pshufb %%xmm12, %%xmm1\n\t"
+			     "por %%xmm1, %%xmm0\n\t"
+			     "movntdq %%xmm0, 0x00(%1)\n\t"
+			     :
+			     : "r"(sbuf), "r"(dbuf + off)
+			     : "memory");
+	}
+
+	fl2000_conv_swar.to_rgb565(dbuf, off, sbuf, pixels);
+}
+
+const struct fl2000_conv fl2000_conv_ssse3 = {
+	.name = "ssse3",
+	.valid = fl2000_ssse3_valid,
+	.begin = fl2000_simd_begin,
+	.end = fl2000_simd_end,
+	.to_rgb565 = fl2000_xrgb888_to_rgb565_ssse3,
+	.to_rgb888 = fl2000_xrgb888_to_rgb888_ssse3,
+};
+
+static void fl2000_xrgb888_to_rgb888_avx2(u8 *dbuf, unsigned int off, const u32 *sbuf, u32 pixels)
+{
+	u32 head = fl2000_conv_head(fl2000_conv_swar.to_rgb888, dbuf, off, sbuf, pixels, 3, 16);
+
+	off += head * 3;
+	sbuf += head;
+	pixels -= head;
+
+	asm volatile("vmovdqa %0, %%ymm8\n\t"
+		     "vmovdqa %1, %%ymm9\n\t"
+		     "vmovdqa %2, %%ymm10\n\t"
+		     :
+		     : "m"(fl2000_avx2_rgb888_mask), "m"(fl2000_avx2_rgb888_perm[0]),
+		       "m"(fl2000_avx2_rgb888_perm[1]));
+
+	for (; pixels >= 16; pixels -= 16, sbuf += 16, off += 48) {
+		asm volatile("vmovdqu 0x00(%0), %%ymm0\n\t"
+			     "vmovdqu 0x20(%0), %%ymm1\n\t"
+			     "vpshufb %%ymm8, %%ymm0, %%ymm0\n\t"
+			     "vpshufb %%ymm8, %%ymm1, %%ymm1\n\t"
+			     "vpermd %%ymm0, %%ymm9, %%ymm2\n\t"
+			     "vpermd %%ymm1, %%ymm10, %%ymm3\n\t"
+			     "vpblendd $0xC0, %%ymm3, %%ymm2, %%ymm2\n\t"
+			     "vextracti128 $1, %%ymm2, %%xmm4\n\t"
+			     "vmovntdq %%xmm2, 0x00(%1)\n\t"
+			     "vmovntdq %%xmm4, 0x10(%1)\n\t"
+			     "vmovntdq %%xmm3, 0x20(%1)\n\t"
+			     :
+			     : "r"(sbuf), "r"(dbuf + off)
+			     : "memory");
+	}
+
+	fl2000_conv_swar.to_rgb888(dbuf, off, sbuf, pixels);
+}
+
+static void fl2000_xrgb888_to_rgb565_avx2(u8 *dbuf, unsigned int off, const u32 *sbuf, u32 pixels)
+{
+	u32 head = fl2000_conv_head(fl2000_conv_swar.to_rgb565, dbuf, off, sbuf, pixels, 2, 32);
+
+	off += head * 2;
+	sbuf += head;
+	pixels -= head;
+
+	asm volatile("vmovdqa %0, %%ymm8\n\t"
+		     "vmovdqa %1, %%ymm9\n\t"
+		     "vmovdqa %2, %%ymm10\n\t"
+		     :
+		     : "m"(fl2000_rgb565_mask[0]), "m"(fl2000_rgb565_mask[1]),
+		       "m"(fl2000_rgb565_mask[2]));
+
+	for (; pixels >= 16; pixels -= 16, sbuf += 16, off += 32) {
+		asm volatile("vmovdqu 0x00(%0), %%ymm0\n\t"
+			     "vmovdqu 0x20(%0), %%ymm1\n\t"
+			     "vpsrld $8, %%ymm0, %%ymm2\n\t"
+			     "vpand %%ymm8, %%ymm2, %%ymm2\n\t"
+			     "vpsrld $5, %%ymm0, %%ymm3\n\t"
+			     "vpand %%ymm9, %%ymm3, %%ymm3\n\t"
+			     "vpor %%ymm3, %%ymm2, %%ymm2\n\t"
+			     "vpsrld $3, %%ymm0, %%ymm0\n\t"
+			     "vpand %%ymm10, %%ymm0, %%ymm0\n\t"
+			     "vpor %%ymm2, %%ymm0, %%ymm0\n\t"
+			     "vpsrld $8, %%ymm1, %%ymm4\n\t"
+			     "vpand %%ymm8, %%ymm4, %%ymm4\n\t"
+			     "vpsrld $5, %%ymm1, %%ymm5\n\t"
+			     "vpand %%ymm9, %%ymm5, %%ymm5\n\t"
+			     "vpor %%ymm5, %%ymm4, %%ymm4\n\t"
+			     "vpsrld $3, %%ymm1, %%ymm1\n\t"
+			     "vpand %%ymm10, %%ymm1, %%ymm1\n\t"
+			     "vpor %%ymm4, %%ymm1, %%ymm1\n\t"
+			     "vpackusdw %%ymm1, %%ymm0, %%ymm0\n\t"
+			     "vpshufd $0xB1, %%ymm0, %%ymm0\n\t"
+			     "vpermq $0xD8, %%ymm0, %%ymm0\n\t"
+			     "vmovntdq %%ymm0, 0x00(%1)\n\t"
+			     :
+			     : "r"(sbuf), "r"(dbuf + off)
+			     : "memory");
+	}
+
+	fl2000_conv_swar.to_rgb565(dbuf, off, sbuf, pixels);
+}
+
+const struct fl2000_conv fl2000_conv_avx2 = {
+	.name = "avx2",
+	.valid = fl2000_avx2_valid,
+	.begin = fl2000_simd_begin,
+	.end = fl2000_avx2_end,
+	.to_rgb565 = fl2000_xrgb888_to_rgb565_avx2,
+	.to_rgb888 = fl2000_xrgb888_to_rgb888_avx2,
+};
@@ -18,10 +18,48 @@
 #define FL20000_MAX_WIDTH  4000
 #define FL20000_MAX_HEIGHT 4000
 
-/* Force using 32-bit XRGB8888 on input for simplicity */
+/* Stream buffers are reused across mode changes; optionally allocate them for the largest mode
+ * of the monitor once at bind time
+ */
+static bool prealloc;
+module_param(prealloc, bool, 0444);
+MODULE_PARM_DESC(prealloc, "Preallocate stream buffers for the largest monitor mode on bind");
+
+/* Device never does DMA from frame buffers, CPU only reads them for conversion. Shmem GEM objects
+ * do not need contiguous memory and are mapped cached; contiguous DMA memory is kept as an option
+ */
+static bool shmem = true;
+module_param(shmem, bool, 0444);
+MODULE_PARM_DESC(shmem, "Back frame buffers with shmem instead of contiguous DMA memory");
+
+/* XRGB8888 is preferred for console. 16 and 24-bit formats matching the wire format are only
+ * swizzled, so clients rendering in them save on memory traffic
+ */
 #define FL2000_FB_BPP 32
 static const u32 fl2000_pixel_formats[] = {
-	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_XRGB8888, DRM_FORMAT_XBGR8888, DRM_FORMAT_RGB565,
+	DRM_FORMAT_RGB888,   DRM_FORMAT_BGR888,
+};
+
+/* Video overlay, converted and composed over the primary plane together with wire packing */
+static const u32 fl2000_overlay_formats[] = {
+	DRM_FORMAT_NV12,
+	DRM_FORMAT_YUYV,
+};
+
+/* Cursor is blended over other planes with premultiplied alpha */
+#define FL2000_CURSOR_SIZE 64
+static const u32 fl2000_cursor_formats[] = {
+	DRM_FORMAT_ARGB8888,
+};
+
+/* Planes may be stretched up to this factor, e.g. to show 720p rendering on 1080p monitor */
+#define FL2000_MAX_UPSCALE 4
+
+static const u64 fl2000_format_modifiers[] = {
+	DRM_FORMAT_MOD_LINEAR,
+	DRM_FORMAT_MOD_FL2000_WIRE,
+	DRM_FORMAT_MOD_INVALID,
 };
 
 /* Maximum pixel clock set to 500MHz. It is hard to get more or less precise PLL configuration for
@@ -42,6 +80,9 @@ static const u32 fl2000_pixel_formats[] = {
 /* Maximum acceptable ppm error */
 #define FL2000_PPM_ERR_MAX 500
 
+/* VBLANK timer is brought back in phase with the hardware frame counter every this many frames */
+#define FL2000_VBLANK_RESYNC 64
+
 /* Assume bulk transfers can use only 80% of USB bandwidth */
 #define FL2000_BULK_BW_PERCENT 80
 
@@ -89,34 +130,167 @@ static unsigned int fl2000_get_bytes_pix(enum usb_device_speed speed, unsigned i
 struct fl2000_drm_if {
 	struct usb_device *usb_dev;
 	struct drm_device drm;
-	struct drm_simple_display_pipe pipe;
+	struct drm_plane plane;
+	struct drm_plane overlay;
+	struct drm_plane cursor;
+	struct drm_crtc crtc;
+	struct drm_encoder encoder;
 	struct fl2000_stream *stream;
 	struct fl2000_intr *intr;
+	struct drm_rect damage[FL2000_CLIP_NUM]; /* Frame damage collected during commit */
+	unsigned int num_damage;
+	bool mirror; /* Device reflects output lines, frame is composed reflected */
+	struct workqueue_struct *render_wq; /* Frames are composed in commit order */
+	/* VBLANK: timer ticks at the refresh rate the PLL actually generates, in phase with the
+	 * hardware frame counter which is read over USB by the work. Frame 'vblank_cnt' started at
+	 * 'vblank_time', following frames are extrapolated. Protected by vblank_lock
+	 */
+	struct hrtimer vblank_timer;
+	struct work_struct vblank_work;
+	spinlock_t vblank_lock;
+	u64 frame_ns; /* Frame period, 0 if no mode is set */
+	ktime_t vblank_time;
+	u32 vblank_cnt;
+	u32 vblank_last; /* Last reported counter, it never goes back */
+	int vblank_err; /* Uncertainty of vblank_time, ns */
+	unsigned int vblank_ticks; /* Timer ticks since the last resynchronization */
+	bool vblank_enabled; /* Timer re-arms itself only while set */
+	u16 hw_frame_cnt; /* Hardware frame counter at the last resynchronization... */
+	u32 hw_frame_base; /* ...and the frame it corresponds to */
+	bool hw_frame_valid; /* Hardware frame counter was not reset since */
+};
+
+/* Frame composition handed over from the commit to the render worker */
+struct fl2000_render {
+	struct work_struct work;
+	struct fl2000_drm_if *drm_if;
+	struct drm_framebuffer *fbs[FL2000_PLANE_NUM];
+	struct iosys_map map[FL2000_PLANE_NUM][DRM_FORMAT_MAX_PLANES];
+	struct fl2000_plane planes[FL2000_PLANE_NUM];
+	unsigned int num_planes;
+	struct drm_rect clips[FL2000_CLIP_NUM];
+	unsigned int num_clips;
+	struct drm_pending_vblank_event *event;
 };
 
-DEFINE_DRM_GEM_DMA_FOPS(fl2000_drm_driver_fops);
+DEFINE_DRM_GEM_DMA_FOPS(fl2000_drm_driver_dma_fops);
+DEFINE_DRM_GEM_FOPS(fl2000_drm_driver_shmem_fops);
 
 static void fl2000_drm_release(struct drm_device *drm)
 {
+	struct fl2000_drm_if *drm_if = drm->dev_private;
+
 	drm_atomic_helper_shutdown(drm);
 	drm_mode_config_cleanup(drm);
+
+	/* Bind may fail before the workqueue is allocated */
+	if (drm_if->render_wq)
+		destroy_workqueue(drm_if->render_wq);
+}
+
+static void fl2000_debugfs_init(struct drm_minor *minor)
+{
+	struct fl2000_drm_if *drm_if = minor->dev->dev_private;
+
+	fl2000_stream_debugfs_init(drm_if->stream, minor->debugfs_root);
+}
+
+/* Shmem GEM object. Imported buffers are mapped once for their lifetime: dma-buf keeps the mapping
+ * while it is in use, so mapping them for every plane update only takes a reference to it
+ */
+struct fl2000_gem_object {
+	struct drm_gem_shmem_object base;
+	struct iosys_map map; /* Persistent mapping of imported buffer */
+};
+
+static void fl2000_gem_free(struct drm_gem_object *obj)
+{
+	struct fl2000_gem_object *fl_obj = container_of(obj, struct fl2000_gem_object, base.base);
+
+	if (obj->import_attach && !iosys_map_is_null(&fl_obj->map))
+		dma_buf_vunmap_unlocked(obj->import_attach->dmabuf, &fl_obj->map);
+
+	drm_gem_shmem_free(&fl_obj->base);
+}
+
+static const struct drm_gem_object_funcs fl2000_gem_funcs = {
+	.free = fl2000_gem_free,
+	.print_info = drm_gem_shmem_object_print_info,
+	.pin = drm_gem_shmem_object_pin,
+	.unpin = drm_gem_shmem_object_unpin,
+	.get_sg_table = drm_gem_shmem_object_get_sg_table,
+	.vmap = drm_gem_shmem_object_vmap,
+	.vunmap = drm_gem_shmem_object_vunmap,
+	.mmap = drm_gem_shmem_object_mmap,
+	.vm_ops = &drm_gem_shmem_vm_ops,
+};
+
+static struct drm_gem_object *fl2000_gem_create_object(struct drm_device *drm, size_t size)
+{
+	struct fl2000_gem_object *fl_obj;
+
+	UNUSED(drm);
+	UNUSED(size);
+
+	fl_obj = kzalloc(sizeof(*fl_obj), GFP_KERNEL);
+	if (!fl_obj)
+		return ERR_PTR(-ENOMEM);
+
+	fl_obj->base.base.funcs = &fl2000_gem_funcs;
+
+	return &fl_obj->base.base;
 }
 
-static struct drm_driver fl2000_drm_driver = {
-	.driver_features = DRIVER_MODESET | DRIVER_GEM | DRIVER_ATOMIC,
-	.lastclose = drm_fb_helper_lastclose,
-	.ioctls = NULL,
-	.fops = &fl2000_drm_driver_fops,
-	.release = fl2000_drm_release,
+/* Frame buffers rendered by other devices are read directly, CPU access to them is synchronized
+ * with exporter on every plane update
+ */
+static struct drm_gem_object *fl2000_gem_prime_import(struct drm_device *drm,
+						      struct dma_buf *dma_buf)
+{
+	int ret;
+	struct drm_gem_object *obj = drm_gem_prime_import(drm, dma_buf);
+	struct fl2000_gem_object *fl_obj;
+
+	/* Own buffers are not imported, only referenced */
+	if (IS_ERR(obj) || !obj->import_attach)
+		return obj;
+
+	fl_obj = container_of(obj, struct fl2000_gem_object, base.base);
+	ret = dma_buf_vmap_unlocked(dma_buf, &fl_obj->map);
+	if (ret) {
+		dev_err(drm->dev, "Cannot map imported buffer (%d)", ret);
+		drm_gem_object_put(obj);
+		return ERR_PTR(ret);
+	}
+
+	return obj;
+}
 
+#define FL2000_DRM_DRIVER_COMMON \
+	.driver_features = DRIVER_MODESET | DRIVER_GEM | DRIVER_ATOMIC, \
+	.lastclose = drm_fb_helper_lastclose, \
+	.ioctls = NULL, \
+	.release = fl2000_drm_release, \
+	.debugfs_init = fl2000_debugfs_init, \
+	.name = DRM_DRIVER_NAME, \
+	.desc = DRM_DRIVER_DESC, \
+	.date = DRM_DRIVER_DATE, \
+	.major = DRM_DRIVER_MAJOR, \
+	.minor = DRM_DRIVER_MINOR, \
+	.patchlevel = DRM_DRIVER_PATCHLEVEL
+
+static const struct drm_driver fl2000_drm_driver_dma = {
+	FL2000_DRM_DRIVER_COMMON,
+	.fops = &fl2000_drm_driver_dma_fops,
 	DRM_GEM_DMA_DRIVER_OPS_VMAP,
+};
 
-	.name = DRM_DRIVER_NAME,
-	.desc = DRM_DRIVER_DESC,
-	.date = DRM_DRIVER_DATE,
-	.major = DRM_DRIVER_MAJOR,
-	.minor = DRM_DRIVER_MINOR,
-	.patchlevel = DRM_DRIVER_PATCHLEVEL,
+static const struct drm_driver fl2000_drm_driver_shmem = {
+	FL2000_DRM_DRIVER_COMMON,
+	.fops = &fl2000_drm_driver_shmem_fops,
+	DRM_GEM_SHMEM_DRIVER_OPS,
+	.gem_create_object = fl2000_gem_create_object,
+	.gem_prime_import = fl2000_gem_prime_import,
 };
 
 static const struct drm_mode_config_funcs fl2000_mode_config_funcs = {
@@ -247,121 +421,784 @@ static int fl2000_mode_calc(const struct drm_display_mode *mode,
 	return -1;
 }
 
-static enum drm_mode_status fl2000_display_mode_valid(struct drm_simple_display_pipe *pipe,
-						      const struct drm_display_mode *mode)
+/* Bytes per pixel on the wire for the mode, 0 if mode cannot be used */
+static unsigned int fl2000_mode_bytes_pix(struct usb_device *usb_dev,
+					  const struct drm_display_mode *mode)
 {
-	struct drm_device *drm = pipe->crtc.dev;
 	struct drm_display_mode adjusted_mode;
 	struct fl2000_pll pll;
-	struct fl2000_drm_if *drm_if = drm->dev_private;
-	struct usb_device *usb_dev = drm_if->usb_dev;
 
 	/* Get PLL configuration and check if mode adjustments needed */
 	if (fl2000_mode_calc(mode, &adjusted_mode, &pll))
-		return MODE_BAD;
+		return 0;
 
-	if (fl2000_get_bytes_pix(usb_dev->speed, adjusted_mode.clock) == 0)
+	return fl2000_get_bytes_pix(usb_dev->speed, adjusted_mode.clock);
+}
+
+static enum drm_mode_status fl2000_crtc_mode_valid(struct drm_crtc *crtc,
+						   const struct drm_display_mode *mode)
+{
+	struct fl2000_drm_if *drm_if = crtc->dev->dev_private;
+
+	if (fl2000_mode_bytes_pix(drm_if->usb_dev, mode) == 0)
 		return MODE_BAD;
 
 	return MODE_OK;
 }
 
-static void fl2000_display_enable(struct drm_simple_display_pipe *pipe,
-				  struct drm_crtc_state *cstate,
-				  struct drm_plane_state *plane_state)
+/* Reserve stream buffers for the largest mode the monitor supports, so that mode changes never
+ * allocate. Monitor has to be connected on bind for its EDID to be read
+ */
+static void fl2000_prealloc_buffers(struct fl2000_drm_if *drm_if)
+{
+	struct drm_device *drm = &drm_if->drm;
+	struct drm_connector_list_iter iter;
+	struct drm_connector *connector;
+	struct drm_display_mode *mode;
+	size_t size = 0;
+
+	mutex_lock(&drm->mode_config.mutex);
+	drm_connector_list_iter_begin(drm, &iter);
+	drm_for_each_connector_iter(connector, &iter) {
+		connector->funcs->fill_modes(connector, drm->mode_config.max_width,
+					     drm->mode_config.max_height);
+		list_for_each_entry(mode, &connector->modes, head)
+			size = max_t(size_t, size, (size_t)mode->hdisplay * mode->vdisplay *
+					fl2000_mode_bytes_pix(drm_if->usb_dev, mode));
+	}
+	drm_connector_list_iter_end(&iter);
+	mutex_unlock(&drm->mode_config.mutex);
+
+	if (size && fl2000_stream_reserve(drm_if->stream, size))
+		dev_warn(drm->dev, "Cannot preallocate stream buffers");
+}
+
+/* Damage is kept as few separate clips, so that moving cursor only converts its old and new
+ * position. Overlapping clips are merged, when there are too many the last one is merged as well.
+ * Merged clip may overlap other ones then, so merging goes on until clips do not overlap
+ */
+static void fl2000_damage_add(struct fl2000_drm_if *drm_if, const struct drm_rect *rect)
 {
-	struct drm_crtc *crtc = &pipe->crtc;
-	struct drm_device *drm = pipe->crtc.dev;
-	struct fl2000_drm_if *drm_if = drm->dev_private;
+	struct drm_rect merged = *rect;
+	bool again;
+
+	do {
+		again = false;
+		for (unsigned int i = 0; i < drm_if->num_damage; i++) {
+			struct drm_rect clip = drm_if->damage[i];
+
+			if (drm_rect_intersect(&clip, &merged)) {
+				fl2000_rect_union(&merged, &drm_if->damage[i]);
+				drm_if->damage[i--] = drm_if->damage[--drm_if->num_damage];
+				again = true;
+			}
+		}
+
+		if (!again && drm_if->num_damage == FL2000_CLIP_NUM) {
+			fl2000_rect_union(&merged, &drm_if->damage[--drm_if->num_damage]);
+			again = true;
+		}
+	} while (again);
+
+	drm_if->damage[drm_if->num_damage++] = merged;
+}
+
+/* Source rectangle is given before rotation */
+static bool fl2000_plane_scaled(struct drm_plane_state *state)
+{
+	bool rotated = drm_rotation_90_or_270(state->rotation);
+	int src_w = rotated ? drm_rect_height(&state->src) : drm_rect_width(&state->src);
+	int src_h = rotated ? drm_rect_width(&state->src) : drm_rect_height(&state->src);
+
+	return src_w != drm_rect_width(&state->dst) << 16 ||
+	       src_h != drm_rect_height(&state->dst) << 16;
+}
+
+/* Plane damage is collected in frame coordinates, frame is composed once all planes are updated.
+ * Moved, rotated, refiltered or hidden plane uncovers what is below it
+ */
+static void fl2000_plane_atomic_update(struct drm_plane *plane, struct drm_atomic_state *state)
+{
+	struct fl2000_drm_if *drm_if = plane->dev->dev_private;
+	struct drm_plane_state *old_state = drm_atomic_get_old_plane_state(state, plane);
+	struct drm_plane_state *new_state = drm_atomic_get_new_plane_state(state, plane);
+	struct drm_rect rect;
+
+	int src_w = drm_rect_width(&new_state->src) >> 16;
+	int src_h = drm_rect_height(&new_state->src) >> 16;
+
+	if (old_state->visible != new_state->visible ||
+	    old_state->rotation != new_state->rotation ||
+	    old_state->scaling_filter != new_state->scaling_filter ||
+	    !drm_rect_equals(&old_state->dst, &new_state->dst)) {
+		if (old_state->visible)
+			fl2000_damage_add(drm_if, &old_state->dst);
+		if (new_state->visible)
+			fl2000_damage_add(drm_if, &new_state->dst);
+	}
+
+	/* Damage clips are in frame buffer coordinates, source is rotated and scaled onto the
+	 * frame. Filtering spreads source pixels over their neighbours
+	 */
+	if (drm_atomic_helper_damage_merged(old_state, new_state, &rect)) {
+		drm_rect_translate(&rect, -(new_state->src.x1 >> 16), -(new_state->src.y1 >> 16));
+		if (fl2000_plane_scaled(new_state)) {
+			rect.x1 = max(rect.x1 - 1, 0);
+			rect.y1 = max(rect.y1 - 1, 0);
+			rect.x2 = min(rect.x2 + 1, src_w);
+			rect.y2 = min(rect.y2 + 1, src_h);
+		}
+		drm_rect_rotate(&rect, src_w, src_h, new_state->rotation);
+		if (drm_rotation_90_or_270(new_state->rotation))
+			swap(src_w, src_h);
+		if (src_w && src_h) {
+			int dst_w = drm_rect_width(&new_state->dst);
+			int dst_h = drm_rect_height(&new_state->dst);
+
+			rect.x1 = rect.x1 * dst_w / src_w;
+			rect.y1 = rect.y1 * dst_h / src_h;
+			rect.x2 = DIV_ROUND_UP(rect.x2 * dst_w, src_w);
+			rect.y2 = DIV_ROUND_UP(rect.y2 * dst_h, src_h);
+		}
+		drm_rect_translate(&rect, new_state->dst.x1, new_state->dst.y1);
+		fl2000_damage_add(drm_if, &rect);
+	}
+}
+
+/* Frame buffer in wire format is transmitted as is, so it has to be frame lines one after another.
+ * It may be taller than the frame and panned vertically. Frame shall start on a page boundary:
+ * slices are then whole pages, so their SG lists fit URB tables and no short packet ends a slice
+ * in the middle of the frame
+ */
+static int fl2000_plane_check_wire(struct fl2000_drm_if *drm_if,
+				   struct drm_plane_state *plane_state,
+				   const struct drm_display_mode *mode)
+{
+	struct drm_framebuffer *fb = plane_state->fb;
+	unsigned int rotation = plane_state->rotation;
+	struct drm_gem_object *obj = fb->obj[0];
+	struct drm_rect frame;
+	unsigned int bytes_pix = fl2000_mode_bytes_pix(drm_if->usb_dev, mode);
+	size_t start = (size_t)(plane_state->src.y1 >> 16) * fb->pitches[0];
+	size_t size = ALIGN((size_t)mode->hdisplay * mode->vdisplay * bytes_pix, 8);
+
+	if (fb->format->cpp[0] != bytes_pix || fb->width != mode->hdisplay ||
+	    fb->pitches[0] != fb->width * bytes_pix || fb->offsets[0] ||
+	    !PAGE_ALIGNED(start) || obj->size < start + size)
+		return -EINVAL;
+
+	/* Imported buffers have no pages of their own */
+	if (obj->import_attach)
+		return -EINVAL;
+
+	/* Only reflection done by the device is possible, and frame is shown unscaled */
+	if (rotation != DRM_MODE_ROTATE_0 && rotation != (DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_X))
+		return -EINVAL;
+
+	drm_rect_init(&frame, 0, plane_state->src.y1 & ~0xFFFF, mode->hdisplay << 16,
+		      mode->vdisplay << 16);
+	if (!drm_rect_equals(&plane_state->src, &frame))
+		return -EINVAL;
+
+	return 0;
+}
+
+/* Primary plane covers the whole frame, overlay and cursor may be anywhere on it. Primary and
+ * overlay may be upscaled, cursor is shown as is
+ */
+static int fl2000_plane_atomic_check(struct drm_plane *plane, struct drm_atomic_state *state)
+{
+	int ret;
+	struct fl2000_drm_if *drm_if = plane->dev->dev_private;
+	struct drm_plane_state *plane_state = drm_atomic_get_new_plane_state(state, plane);
+	struct drm_crtc_state *crtc_state = drm_atomic_get_new_crtc_state(state, &drm_if->crtc);
+	bool primary = (plane->type == DRM_PLANE_TYPE_PRIMARY);
+	int min_scale = DRM_PLANE_NO_SCALING;
+
+	if (plane->type != DRM_PLANE_TYPE_CURSOR)
+		min_scale /= FL2000_MAX_UPSCALE;
+
+	ret = drm_atomic_helper_check_plane_state(plane_state, crtc_state, min_scale,
+						  DRM_PLANE_NO_SCALING, !primary, !primary);
+	if (ret || !plane_state->visible)
+		return ret;
+
+	if (plane_state->fb->modifier == DRM_FORMAT_MOD_FL2000_WIRE)
+		return fl2000_plane_check_wire(drm_if, plane_state, &crtc_state->mode);
+
+	return 0;
+}
+
+/* Wire format is transmitted from pages of shmem frame buffers */
+static bool fl2000_plane_format_mod_supported(struct drm_plane *plane, u32 format, u64 modifier)
+{
+	if (modifier == DRM_FORMAT_MOD_FL2000_WIRE)
+		return shmem && plane->type == DRM_PLANE_TYPE_PRIMARY &&
+		       (format == DRM_FORMAT_RGB565 || format == DRM_FORMAT_RGB888);
+
+	return modifier == DRM_FORMAT_MOD_LINEAR;
+}
+
+/* Frame buffers stay mapped while their plane state is current, so planes that are not part of a
+ * commit are composed together with the ones that are
+ */
+static int fl2000_plane_prepare_fb(struct drm_plane *plane, struct drm_plane_state *state)
+{
+	int ret;
+	struct drm_shadow_plane_state *shadow_state = to_drm_shadow_plane_state(state);
+
+	if (!state->fb)
+		return 0;
+
+	ret = drm_gem_plane_helper_prepare_fb(plane, state);
+	if (ret)
+		return ret;
+
+	return drm_gem_fb_vmap(state->fb, shadow_state->map, shadow_state->data);
+}
+
+static void fl2000_plane_cleanup_fb(struct drm_plane *plane, struct drm_plane_state *state)
+{
+	struct drm_shadow_plane_state *shadow_state = to_drm_shadow_plane_state(state);
+
+	UNUSED(plane);
+
+	if (state->fb)
+		drm_gem_fb_vunmap(state->fb, shadow_state->map);
+}
+
+static const struct drm_plane_helper_funcs fl2000_plane_helper_funcs = {
+	.prepare_fb = fl2000_plane_prepare_fb,
+	.cleanup_fb = fl2000_plane_cleanup_fb,
+	.atomic_check = fl2000_plane_atomic_check,
+	.atomic_update = fl2000_plane_atomic_update,
+};
+
+static const struct drm_plane_funcs fl2000_plane_funcs = {
+	.update_plane = drm_atomic_helper_update_plane,
+	.disable_plane = drm_atomic_helper_disable_plane,
+	.destroy = drm_plane_cleanup,
+	.format_mod_supported = fl2000_plane_format_mod_supported,
+	DRM_GEM_SHADOW_PLANE_FUNCS,
+};
+
+static void fl2000_plane_fill(struct fl2000_plane *plane, struct drm_plane_state *state,
+			      const struct iosys_map *data)
+{
+	struct drm_framebuffer *fb = state->fb;
+
+	/* Mapping already includes color plane offsets */
+	plane->format = fb->format;
+	plane->modifier = fb->modifier;
+	for (int i = 0; i < fb->format->num_planes; i++) {
+		plane->vaddr[i] = data[i].vaddr;
+		plane->pitch[i] = fb->pitches[i];
+	}
+	plane->dst = state->dst;
+	plane->src = state->src;
+	plane->rotation = state->rotation;
+	plane->scaled = fl2000_plane_scaled(state);
+	plane->scaling_filter = state->scaling_filter;
+	plane->color_encoding = state->color_encoding;
+	plane->color_range = state->color_range;
+}
+
+/* Reflect plane horizontally on the frame. Reflection after rotation is the same as reflection
+ * before rotation the other way round
+ */
+static void fl2000_plane_mirror(struct fl2000_plane *plane, int width)
+{
+	unsigned int rotate = plane->rotation & DRM_MODE_ROTATE_MASK;
+	int x1 = plane->dst.x1;
+
+	plane->dst.x1 = width - plane->dst.x2;
+	plane->dst.x2 = width - x1;
+
+	if (rotate == DRM_MODE_ROTATE_90)
+		rotate = DRM_MODE_ROTATE_270;
+	else if (rotate == DRM_MODE_ROTATE_270)
+		rotate = DRM_MODE_ROTATE_90;
+
+	plane->rotation = rotate | ((plane->rotation & DRM_MODE_REFLECT_MASK) ^ DRM_MODE_REFLECT_X);
+}
+
+/* Event is sent once the composed frame is transmitted, or at once if CRTC is off */
+static void fl2000_crtc_send_event(struct drm_crtc *crtc, struct drm_pending_vblank_event *event)
+{
+	struct drm_device *drm = crtc->dev;
+
+	spin_lock_irq(&drm->event_lock);
+	if (drm_crtc_vblank_get(crtc) == 0)
+		drm_crtc_arm_vblank_event(crtc, event);
+	else
+		drm_crtc_send_vblank_event(crtc, event);
+	spin_unlock_irq(&drm->event_lock);
+}
+
+static void fl2000_render_free(struct fl2000_render *render)
+{
+	for (unsigned int i = 0; i < render->num_planes; i++) {
+		drm_gem_fb_vunmap(render->fbs[i], render->map[i]);
+		drm_framebuffer_put(render->fbs[i]);
+	}
+
+	kfree(render);
+}
+
+/* Compose the frame from its snapshot. Frame buffer in wire format that is the only visible plane
+ * is transmitted as is
+ */
+static void fl2000_render_work(struct work_struct *work)
+{
+	int ret = 0;
+	int idx;
+	struct fl2000_render *render = container_of(work, struct fl2000_render, work);
+	struct fl2000_drm_if *drm_if = render->drm_if;
+	struct drm_device *drm = &drm_if->drm;
+	struct drm_framebuffer **fbs = render->fbs;
+	unsigned int num_planes = render->num_planes;
+
+	if (!drm_dev_enter(drm, &idx)) {
+		dev_err(drm->dev, "DRM enter failed!");
+		goto exit;
+	}
 
-	/* TODO: check cstate/pstate? */
-	UNUSED(cstate);
-	UNUSED(plane_state);
+	/* Pages of the frame buffer are there while it is mapped */
+	if (num_planes == 1 && fbs[0]->modifier == DRM_FORMAT_MOD_FL2000_WIRE) {
+		struct drm_gem_object *obj = fbs[0]->obj[0];
+		struct drm_rect rect = {};
 
-	fl2000_stream_enable(drm_if->stream);
+		for (unsigned int i = 0; i < render->num_clips; i++)
+			fl2000_rect_union(&rect, &render->clips[i]);
+
+		fl2000_stream_scanout(drm_if->stream, to_drm_gem_shmem_obj(obj)->pages,
+				      obj->size >> PAGE_SHIFT,
+				      (size_t)(render->planes[0].src.y1 >> 16) * fbs[0]->pitches[0],
+				      &rect);
+		goto exit_dev;
+	}
+
+	for (int i = 0; i < num_planes; i++) {
+		ret = drm_gem_fb_begin_cpu_access(fbs[i], DMA_FROM_DEVICE);
+		if (ret) {
+			while (i--)
+				drm_gem_fb_end_cpu_access(fbs[i], DMA_FROM_DEVICE);
+			goto exit_dev;
+		}
+	}
+
+	fl2000_stream_compress(drm_if->stream, render->planes, num_planes, render->clips,
+			       render->num_clips);
+
+	for (int i = 0; i < num_planes; i++)
+		drm_gem_fb_end_cpu_access(fbs[i], DMA_FROM_DEVICE);
+
+exit_dev:
+	drm_dev_exit(idx);
+exit:
+	if (render->event)
+		fl2000_crtc_send_event(&drm_if->crtc, render->event);
+
+	fl2000_render_free(render);
+}
+
+/* Take snapshot of visible planes for composition, bottom to top. Planes that are not part of the
+ * commit are taken from their current state. Frame buffers are referenced and mapped by the
+ * snapshot, so following commits may replace them before the frame is composed. When the device
+ * reflects output, frame is composed reflected
+ */
+static struct fl2000_render *fl2000_render_prepare(struct fl2000_drm_if *drm_if,
+						   struct drm_atomic_state *state)
+{
+	int ret;
+	struct drm_plane *kms_planes[FL2000_PLANE_NUM] = {
+		&drm_if->plane, &drm_if->overlay, &drm_if->cursor
+	};
+	struct fl2000_render *render;
+	int width = drm_if->crtc.state->mode.hdisplay;
+
+	render = kzalloc(sizeof(*render), GFP_KERNEL);
+	if (!render)
+		return NULL;
+
+	INIT_WORK(&render->work, fl2000_render_work);
+	render->drm_if = drm_if;
+
+	for (int i = 0; i < FL2000_PLANE_NUM; i++) {
+		struct drm_plane *kms_plane = kms_planes[i];
+		struct drm_plane_state *plane_state =
+			drm_atomic_get_new_plane_state(state, kms_plane) ?: kms_plane->state;
+		unsigned int n = render->num_planes;
+		struct iosys_map data[DRM_FORMAT_MAX_PLANES];
+
+		if (!plane_state->visible)
+			continue;
+
+		ret = drm_gem_fb_vmap(plane_state->fb, render->map[n], data);
+		if (ret) {
+			fl2000_render_free(render);
+			return NULL;
+		}
+
+		render->fbs[n] = plane_state->fb;
+		drm_framebuffer_get(render->fbs[n]);
+		fl2000_plane_fill(&render->planes[n], plane_state, data);
+		if (drm_if->mirror)
+			fl2000_plane_mirror(&render->planes[n], width);
+		render->num_planes++;
+	}
+
+	for (unsigned int i = 0; i < drm_if->num_damage; i++) {
+		struct drm_rect *clip = &render->clips[i];
+
+		*clip = drm_if->damage[i];
+		if (drm_if->mirror) {
+			clip->x1 = width - drm_if->damage[i].x2;
+			clip->x2 = width - drm_if->damage[i].x1;
+		}
+	}
+	render->num_clips = drm_if->num_damage;
+
+	return render;
+}
+
+/* Frame comes from the primary plane only, so CRTC cannot be enabled without it */
+static int fl2000_crtc_atomic_check(struct drm_crtc *crtc, struct drm_atomic_state *state)
+{
+	struct drm_crtc_state *crtc_state = drm_atomic_get_new_crtc_state(state, crtc);
+	bool has_primary = crtc_state->plane_mask & drm_plane_mask(crtc->primary);
+
+	if (has_primary != crtc_state->enable)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* Frames rendered so far are queued for transmission before stream changes */
+static void fl2000_crtc_atomic_enable(struct drm_crtc *crtc, struct drm_atomic_state *state)
+{
+	int ret;
+	struct fl2000_drm_if *drm_if = crtc->dev->dev_private;
+
+	UNUSED(state);
+
+	flush_workqueue(drm_if->render_wq);
+
+	ret = fl2000_stream_enable(drm_if->stream);
+	if (ret)
+		dev_err(crtc->dev->dev, "Cannot enable stream (%d)", ret);
 
 	drm_crtc_vblank_on(crtc);
 }
 
-static void fl2000_display_disable(struct drm_simple_display_pipe *pipe)
+static void fl2000_crtc_atomic_disable(struct drm_crtc *crtc, struct drm_atomic_state *state)
 {
-	struct drm_crtc *crtc = &pipe->crtc;
-	struct drm_device *drm = pipe->crtc.dev;
-	struct fl2000_drm_if *drm_if = drm->dev_private;
+	struct fl2000_drm_if *drm_if = crtc->dev->dev_private;
+
+	UNUSED(state);
+
+	flush_workqueue(drm_if->render_wq);
 
 	fl2000_stream_disable(drm_if->stream);
 
 	drm_crtc_vblank_off(crtc);
+	cancel_work_sync(&drm_if->vblank_work);
+}
+
+/* Planes are updated by now. Frame is composed asynchronously, so commit does not wait for the
+ * conversion; event (and out-fence with it) is armed once the composed frame is queued for
+ * transmission. Damage that cannot be rendered now is kept for the next commit
+ */
+static void fl2000_crtc_atomic_flush(struct drm_crtc *crtc, struct drm_atomic_state *state)
+{
+	struct drm_device *drm = crtc->dev;
+	struct fl2000_drm_if *drm_if = drm->dev_private;
+	struct drm_pending_vblank_event *event = crtc->state->event;
+	struct drm_plane_state *primary_state = crtc->primary->state;
+	struct fl2000_render *render = NULL;
+	bool mirror;
+
+	crtc->state->event = NULL;
+
+	/* Reflected primary plane is left to the device, so it is converted (or transmitted) as
+	 * is. Changing primary rotation damages the whole frame anyway
+	 */
+	mirror = primary_state->visible &&
+		 primary_state->rotation == (DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_X);
+	if (mirror != drm_if->mirror) {
+		/* Frames already queued for rendering keep the old mode. Device is switched when
+		 * the first frame composed for the new one is transmitted
+		 */
+		flush_workqueue(drm_if->render_wq);
+		fl2000_stream_set_mirror(drm_if->stream, mirror);
+		drm_if->mirror = mirror;
+	}
+
+	if (drm_if->num_damage && crtc->state->active) {
+		render = fl2000_render_prepare(drm_if, state);
+		if (render)
+			drm_if->num_damage = 0;
+	}
+
+	if (render) {
+		render->event = event;
+		queue_work(drm_if->render_wq, &render->work);
+	} else if (event) {
+		fl2000_crtc_send_event(crtc, event);
+	}
+}
+
+/* Number and start time of the frame being scanned out at 'now'. Called with vblank_lock held */
+static u32 fl2000_vblank_frame(struct fl2000_drm_if *drm_if, ktime_t now, ktime_t *start)
+{
+	u64 n = 0;
+
+	if (ktime_after(now, drm_if->vblank_time))
+		n = div64_u64(ktime_to_ns(ktime_sub(now, drm_if->vblank_time)), drm_if->frame_ns);
+
+	*start = ktime_add_ns(drm_if->vblank_time, n * drm_if->frame_ns);
+
+	return drm_if->vblank_cnt + (u32)n;
 }
 
-static void fb2000_dirty(struct drm_framebuffer *fb, struct drm_rect *rect)
+/* Hardware frame counter is read once per resynchronization. Frame it shows started no later
+ * than the read, and the next one did not start before it, so the timer is moved in phase only if
+ * it contradicts that. Frames counted by hardware since the previous resynchronization are taken
+ * as they are, timer only extrapolates between resynchronizations, so its drift against the PLL
+ * does not accumulate
+ */
+static void fl2000_vblank_work(struct work_struct *work)
 {
 	int ret;
 	int idx;
-	struct drm_device *drm = fb->dev;
-	struct fl2000_drm_if *drm_if = drm->dev_private;
-	struct drm_gem_dma_object *dma_obj = drm_fb_dma_get_gem_obj(fb, 0);
+	struct fl2000_drm_if *drm_if = container_of(work, struct fl2000_drm_if, vblank_work);
+	struct drm_device *drm = &drm_if->drm;
+	ktime_t before, t, start;
+	u32 frame_cnt;
+	u32 cnt, hw_cnt;
 
-	UNUSED(rect);
+	if (!drm_dev_enter(drm, &idx))
+		return;
 
-	if (!drm_dev_enter(fb->dev, &idx)) {
-		dev_err(drm->dev, "DRM enter failed!");
+	before = ktime_get();
+	ret = fl2000_get_frame_cnt(drm_if->usb_dev, &frame_cnt);
+	t = ktime_get();
+
+	drm_dev_exit(idx);
+
+	if (ret < 0)
 		return;
-	}
 
-	ret = drm_gem_fb_begin_cpu_access(fb, DMA_FROM_DEVICE);
+	/* Reading status cleared sink events, interrupt handling takes them from here */
 	if (ret)
-		return;
+		fl2000_intr_sink_event(drm_if->intr);
+
+	spin_lock_irq(&drm_if->vblank_lock);
+	if (drm_if->frame_ns) {
+		cnt = fl2000_vblank_frame(drm_if, t, &start);
+		hw_cnt = cnt;
+		if (drm_if->hw_frame_valid) {
+			hw_cnt = drm_if->hw_frame_base + (u16)(frame_cnt - drm_if->hw_frame_cnt);
+			if ((s32)(hw_cnt - cnt) > 0) {
+				/* Timer is late, hardware frame started before read completed */
+				drm_if->vblank_cnt = hw_cnt;
+				drm_if->vblank_time = t;
+			} else if ((s32)(hw_cnt - cnt) < 0) {
+				/* Timer is early, next hardware frame did not start before read */
+				drm_if->vblank_cnt = hw_cnt + 1;
+				drm_if->vblank_time = before;
+			}
+		}
+		drm_if->vblank_err = (int)min_t(s64, ktime_to_ns(ktime_sub(t, before)), INT_MAX);
+		drm_if->hw_frame_cnt = (u16)frame_cnt;
+		drm_if->hw_frame_base = hw_cnt;
+		drm_if->hw_frame_valid = true;
+	}
+	spin_unlock_irq(&drm_if->vblank_lock);
+}
 
-	fl2000_stream_compress(drm_if->stream, dma_obj->vaddr, fb->height, fb->width,
-			       fb->pitches[0]);
+/* VBLANK is signalled at the start of each frame, and the timer is brought back in phase with
+ * hardware once in a while
+ */
+static enum hrtimer_restart fl2000_vblank_timer(struct hrtimer *timer)
+{
+	struct fl2000_drm_if *drm_if = container_of(timer, struct fl2000_drm_if, vblank_timer);
+	unsigned long flags;
+	bool resync = false;
+	ktime_t start;
 
-	drm_gem_fb_end_cpu_access(fb, DMA_FROM_DEVICE);
+	if (!READ_ONCE(drm_if->vblank_enabled))
+		return HRTIMER_NORESTART;
 
-	drm_dev_exit(idx);
+	drm_crtc_handle_vblank(&drm_if->crtc);
+
+	spin_lock_irqsave(&drm_if->vblank_lock, flags);
+	if (!drm_if->vblank_enabled || !drm_if->frame_ns) {
+		spin_unlock_irqrestore(&drm_if->vblank_lock, flags);
+		return HRTIMER_NORESTART;
+	}
+	fl2000_vblank_frame(drm_if, ktime_get(), &start);
+	hrtimer_set_expires(timer, ktime_add_ns(start, drm_if->frame_ns));
+	if (++drm_if->vblank_ticks >= FL2000_VBLANK_RESYNC) {
+		drm_if->vblank_ticks = 0;
+		resync = true;
+	}
+	spin_unlock_irqrestore(&drm_if->vblank_lock, flags);
+
+	if (resync)
+		schedule_work(&drm_if->vblank_work);
+
+	return HRTIMER_RESTART;
 }
 
-static void fl2000_display_update(struct drm_simple_display_pipe *pipe,
-				  struct drm_plane_state *old_state)
+/* Configure VBLANK timing for the frame period of the mode. Counter goes on across mode changes,
+ * hardware frame counter does not since the device is reset
+ */
+static void fl2000_vblank_mode_set(struct fl2000_drm_if *drm_if, u64 frame_ns)
 {
-	struct drm_crtc *crtc = &pipe->crtc;
-	struct drm_device *drm = crtc->dev;
-	struct drm_pending_vblank_event *event = crtc->state->event;
-	struct drm_plane_state *state = pipe->plane.state;
-	struct drm_rect rect;
+	ktime_t now = ktime_get();
+	ktime_t start;
+
+	spin_lock_irq(&drm_if->vblank_lock);
+	if (drm_if->frame_ns)
+		drm_if->vblank_cnt = fl2000_vblank_frame(drm_if, now, &start) + 1;
+	drm_if->vblank_time = now;
+	drm_if->frame_ns = frame_ns;
+	drm_if->vblank_err = 0;
+	drm_if->hw_frame_valid = false;
+	spin_unlock_irq(&drm_if->vblank_lock);
+}
+
+static int fl2000_crtc_enable_vblank(struct drm_crtc *crtc)
+{
+	struct fl2000_drm_if *drm_if = crtc->dev->dev_private;
+	unsigned long flags;
+	ktime_t start;
+
+	spin_lock_irqsave(&drm_if->vblank_lock, flags);
+	if (!drm_if->frame_ns) {
+		spin_unlock_irqrestore(&drm_if->vblank_lock, flags);
+		return -EINVAL;
+	}
+	fl2000_vblank_frame(drm_if, ktime_get(), &start);
+	start = ktime_add_ns(start, drm_if->frame_ns);
+	drm_if->vblank_ticks = 0;
+	drm_if->vblank_enabled = true;
+	spin_unlock_irqrestore(&drm_if->vblank_lock, flags);
+
+	hrtimer_start(&drm_if->vblank_timer, start, HRTIMER_MODE_ABS);
+	schedule_work(&drm_if->vblank_work);
+
+	return 0;
+}
+
+/* Called with VBLANK time lock held, which the timer takes to signal VBLANK, so the timer is not
+ * waited for: it sees VBLANK disabled and does not re-arm
+ */
+static void fl2000_crtc_disable_vblank(struct drm_crtc *crtc)
+{
+	struct fl2000_drm_if *drm_if = crtc->dev->dev_private;
+	unsigned long flags;
 
-	if (drm_atomic_helper_damage_merged(old_state, state, &rect))
-		fb2000_dirty(state->fb, &rect);
+	spin_lock_irqsave(&drm_if->vblank_lock, flags);
+	drm_if->vblank_enabled = false;
+	spin_unlock_irqrestore(&drm_if->vblank_lock, flags);
 
-	if (event) {
-		crtc->state->event = NULL;
+	hrtimer_try_to_cancel(&drm_if->vblank_timer);
+}
+
+/* Counter is extrapolated from the last hardware frame counter reading, so it runs while VBLANK
+ * interrupts are off
+ */
+static u32 fl2000_crtc_get_vblank_counter(struct drm_crtc *crtc)
+{
+	struct fl2000_drm_if *drm_if = crtc->dev->dev_private;
+	unsigned long flags;
+	ktime_t start;
+	u32 cnt;
+
+	spin_lock_irqsave(&drm_if->vblank_lock, flags);
+	cnt = drm_if->vblank_cnt;
+	if (drm_if->frame_ns)
+		cnt = fl2000_vblank_frame(drm_if, ktime_get(), &start);
+	if ((s32)(cnt - drm_if->vblank_last) < 0)
+		cnt = drm_if->vblank_last;
+	drm_if->vblank_last = cnt;
+	spin_unlock_irqrestore(&drm_if->vblank_lock, flags);
+
+	return cnt;
+}
 
-		spin_lock_irq(&drm->event_lock);
-		if (crtc->state->active && drm_crtc_vblank_get(crtc) == 0)
-			drm_crtc_arm_vblank_event(crtc, event);
-		else
-			drm_crtc_send_vblank_event(crtc, event);
-		spin_unlock_irq(&drm->event_lock);
+static bool fl2000_crtc_get_vblank_timestamp(struct drm_crtc *crtc, int *max_error,
+					     ktime_t *vblank_time, bool in_vblank_irq)
+{
+	struct fl2000_drm_if *drm_if = crtc->dev->dev_private;
+	unsigned long flags;
+	bool valid;
+
+	UNUSED(in_vblank_irq);
+
+	spin_lock_irqsave(&drm_if->vblank_lock, flags);
+	valid = drm_if->frame_ns != 0;
+	if (valid) {
+		fl2000_vblank_frame(drm_if, ktime_get(), vblank_time);
+		*max_error = drm_if->vblank_err;
 	}
+	spin_unlock_irqrestore(&drm_if->vblank_lock, flags);
+
+	return valid;
+}
+
+/* Core accepts targets up to the next VBLANK, which is when any flip completes anyway. It takes a
+ * VBLANK reference for the flip and leaves it to the driver once the flip is committed. Flip event
+ * holds its own reference until it is sent, so this one is dropped right away
+ */
+static int fl2000_crtc_page_flip_target(struct drm_crtc *crtc, struct drm_framebuffer *fb,
+					struct drm_pending_vblank_event *event, u32 flags,
+					u32 target, struct drm_modeset_acquire_ctx *ctx)
+{
+	int ret = drm_atomic_helper_page_flip_target(crtc, fb, event, flags, target, ctx);
+
+	if (!ret)
+		drm_crtc_vblank_put(crtc);
+
+	return ret;
 }
 
-/* Logical pipe management (no HW configuration here) */
-static const struct drm_simple_display_pipe_funcs fl2000_display_funcs = {
-	.mode_valid = fl2000_display_mode_valid,
-	.enable = fl2000_display_enable,
-	.disable = fl2000_display_disable,
-	.update = fl2000_display_update
+/* Logical CRTC management (no HW configuration here) */
+static const struct drm_crtc_helper_funcs fl2000_crtc_helper_funcs = {
+	.mode_valid = fl2000_crtc_mode_valid,
+	.atomic_check = fl2000_crtc_atomic_check,
+	.atomic_enable = fl2000_crtc_atomic_enable,
+	.atomic_disable = fl2000_crtc_atomic_disable,
+	.atomic_flush = fl2000_crtc_atomic_flush,
+};
+
+static const struct drm_crtc_funcs fl2000_crtc_funcs = {
+	.reset = drm_atomic_helper_crtc_reset,
+	.destroy = drm_crtc_cleanup,
+	.set_config = drm_atomic_helper_set_config,
+	.page_flip = drm_atomic_helper_page_flip,
+	.page_flip_target = fl2000_crtc_page_flip_target,
+	.atomic_duplicate_state = drm_atomic_helper_crtc_duplicate_state,
+	.atomic_destroy_state = drm_atomic_helper_crtc_destroy_state,
+	.enable_vblank = fl2000_crtc_enable_vblank,
+	.disable_vblank = fl2000_crtc_disable_vblank,
+	.get_vblank_counter = fl2000_crtc_get_vblank_counter,
+	.get_vblank_timestamp = fl2000_crtc_get_vblank_timestamp,
 };
 
 static void fl2000_output_mode_set(struct drm_encoder *encoder, struct drm_display_mode *mode,
 				   struct drm_display_mode *adjusted_mode)
 {
+	int ret;
 	struct drm_device *drm = encoder->dev;
 	struct fl2000_drm_if *drm_if = drm->dev_private;
 	struct usb_device *usb_dev = drm_if->usb_dev;
 	struct fl2000_timings timings;
 	struct fl2000_pll pll;
 	unsigned int bytes_pix;
+	u64 frame_ns;
 
 	/* Get PLL configuration and cehc if mode adjustments needed */
 	if (fl2000_mode_calc(mode, adjusted_mode, &pll))
@@ -405,7 +1242,18 @@ static void fl2000_output_mode_set(struct drm_encoder *encoder, struct drm_displ
 
 	fl2000_afe_magic(usb_dev);
 
-	fl2000_stream_mode_set(drm_if->stream, mode->hdisplay * mode->vdisplay, bytes_pix);
+	/* Frame period of the clock the PLL generates, not of the requested one */
+	frame_ns = (u64)adjusted_mode->htotal * adjusted_mode->vtotal * pll.divisor * NSEC_PER_SEC;
+	fl2000_vblank_mode_set(drm_if, div_u64(frame_ns, FL2000_XTAL / pll.prescaler *
+							 pll.multiplier));
+
+	/* Frames of the previous mode are gone with the stream buffers */
+	flush_workqueue(drm_if->render_wq);
+
+	/* Stream without buffers drops frames and is not enabled */
+	ret = fl2000_stream_mode_set(drm_if->stream, mode->hdisplay, mode->vdisplay, bytes_pix);
+	if (ret)
+		dev_err(drm->dev, "Cannot set stream mode (%d)", ret);
 }
 
 /* FL2000 HW control functions: mode configuration, turn on/off */
@@ -424,6 +1272,11 @@ static void fl2000_drm_if_release(struct device *dev, void *res)
 	/* Detach bridge */
 	component_unbind_all(dev, drm);
 
+	/* Frames being rendered are transmitted to the stream */
+	flush_workqueue(drm_if->render_wq);
+	hrtimer_cancel(&drm_if->vblank_timer);
+	cancel_work_sync(&drm_if->vblank_work);
+
 	/* Start streaming interface */
 	fl2000_stream_destroy(usb_dev);
 
@@ -445,10 +1298,13 @@ int fl2000_drm_bind(struct device *master)
 	struct drm_device *drm;
 	struct drm_mode_config *mode_config;
 	u64 dma_mask;
+	unsigned int filters;
 
 	dev_info(master, "Binding FL2000 master");
 
-	drm_if = devm_drm_dev_alloc(master, &fl2000_drm_driver, struct fl2000_drm_if, drm);
+	drm_if = devm_drm_dev_alloc(master,
+				    shmem ? &fl2000_drm_driver_shmem : &fl2000_drm_driver_dma,
+				    struct fl2000_drm_if, drm);
 	if (IS_ERR(drm_if)) {
 		dev_err(master, "Cannot allocate DRM structure (%ld)", PTR_ERR(drm_if));
 		return (int)PTR_ERR(drm_if);
@@ -457,6 +1313,17 @@ int fl2000_drm_bind(struct device *master)
 	drm_if->usb_dev = usb_dev;
 	drm->dev_private = drm_if;
 
+	drm_if->render_wq = alloc_ordered_workqueue("fl2000-render", 0);
+	if (!drm_if->render_wq) {
+		dev_err(master, "Cannot allocate render workqueue");
+		return -ENOMEM;
+	}
+
+	spin_lock_init(&drm_if->vblank_lock);
+	hrtimer_init(&drm_if->vblank_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	drm_if->vblank_timer.function = fl2000_vblank_timer;
+	INIT_WORK(&drm_if->vblank_work, fl2000_vblank_work);
+
 	ret = drmm_mode_config_init(drm);
 	if (ret) {
 		dev_err(master, "Cannot initialize DRM mode (%d)", ret);
@@ -469,6 +1336,8 @@ int fl2000_drm_bind(struct device *master)
 	mode_config->max_width = FL20000_MAX_WIDTH;
 	mode_config->min_height = 1;
 	mode_config->max_height = FL20000_MAX_HEIGHT;
+	mode_config->cursor_width = FL2000_CURSOR_SIZE;
+	mode_config->cursor_height = FL2000_CURSOR_SIZE;
 
 	/* Set DMA mask for DRM device from mask of the 'parent' USB device */
 	dma_mask = dma_get_mask(&usb_dev->dev);
@@ -478,25 +1347,94 @@ int fl2000_drm_bind(struct device *master)
 		return ret;
 	}
 
-	ret = drm_simple_display_pipe_init(drm, &drm_if->pipe, &fl2000_display_funcs,
-					   fl2000_pixel_formats, ARRAY_SIZE(fl2000_pixel_formats),
-					   NULL, NULL);
+	ret = drm_universal_plane_init(drm, &drm_if->plane, 0, &fl2000_plane_funcs,
+				       fl2000_pixel_formats, ARRAY_SIZE(fl2000_pixel_formats),
+				       fl2000_format_modifiers, DRM_PLANE_TYPE_PRIMARY, NULL);
+	if (ret) {
+		dev_err(drm->dev, "Cannot initialize plane (%d)", ret);
+		return ret;
+	}
+	drm_plane_helper_add(&drm_if->plane, &fl2000_plane_helper_funcs);
+
+	ret = drm_universal_plane_init(drm, &drm_if->cursor, 0, &fl2000_plane_funcs,
+				       fl2000_cursor_formats, ARRAY_SIZE(fl2000_cursor_formats),
+				       fl2000_format_modifiers, DRM_PLANE_TYPE_CURSOR, NULL);
+	if (ret) {
+		dev_err(drm->dev, "Cannot initialize cursor plane (%d)", ret);
+		return ret;
+	}
+	drm_plane_helper_add(&drm_if->cursor, &fl2000_plane_helper_funcs);
+
+	ret = drm_crtc_init_with_planes(drm, &drm_if->crtc, &drm_if->plane, &drm_if->cursor,
+					&fl2000_crtc_funcs, NULL);
+	if (ret) {
+		dev_err(drm->dev, "Cannot initialize CRTC (%d)", ret);
+		return ret;
+	}
+	drm_crtc_helper_add(&drm_if->crtc, &fl2000_crtc_helper_funcs);
+
+	ret = drm_universal_plane_init(drm, &drm_if->overlay, drm_crtc_mask(&drm_if->crtc),
+				       &fl2000_plane_funcs, fl2000_overlay_formats,
+				       ARRAY_SIZE(fl2000_overlay_formats), fl2000_format_modifiers,
+				       DRM_PLANE_TYPE_OVERLAY, NULL);
+	if (ret) {
+		dev_err(drm->dev, "Cannot initialize overlay plane (%d)", ret);
+		return ret;
+	}
+	drm_plane_helper_add(&drm_if->overlay, &fl2000_plane_helper_funcs);
+
+	ret = drm_plane_create_color_properties(&drm_if->overlay,
+						BIT(DRM_COLOR_YCBCR_BT601) |
+						BIT(DRM_COLOR_YCBCR_BT709),
+						BIT(DRM_COLOR_YCBCR_LIMITED_RANGE) |
+						BIT(DRM_COLOR_YCBCR_FULL_RANGE),
+						DRM_COLOR_YCBCR_BT601,
+						DRM_COLOR_YCBCR_LIMITED_RANGE);
+	if (ret) {
+		dev_err(drm->dev, "Cannot create overlay color properties (%d)", ret);
+		return ret;
+	}
+
+	/* Rotation and reflection are done while converting, e.g. for portrait monitors */
+	ret = drm_plane_create_rotation_property(&drm_if->plane, DRM_MODE_ROTATE_0,
+						 DRM_MODE_ROTATE_MASK | DRM_MODE_REFLECT_MASK);
+	if (!ret)
+		ret = drm_plane_create_rotation_property(&drm_if->overlay, DRM_MODE_ROTATE_0,
+							 DRM_MODE_ROTATE_MASK |
+							 DRM_MODE_REFLECT_MASK);
+	if (ret) {
+		dev_err(drm->dev, "Cannot create rotation properties (%d)", ret);
+		return ret;
+	}
+
+	/* Scaled planes are filtered bilinearly by default */
+	filters = BIT(DRM_SCALING_FILTER_DEFAULT) | BIT(DRM_SCALING_FILTER_NEAREST_NEIGHBOR);
+	ret = drm_plane_create_scaling_filter_property(&drm_if->plane, filters);
+	if (!ret)
+		ret = drm_plane_create_scaling_filter_property(&drm_if->overlay, filters);
+	if (ret) {
+		dev_err(drm->dev, "Cannot create scaling filter properties (%d)", ret);
+		return ret;
+	}
+
+	ret = drm_simple_encoder_init(drm, &drm_if->encoder, DRM_MODE_ENCODER_NONE);
 	if (ret) {
-		dev_err(drm->dev, "Cannot configure simple display pipe (%d)", ret);
+		dev_err(drm->dev, "Cannot initialize encoder (%d)", ret);
 		return ret;
 	}
+	drm_if->encoder.possible_crtcs = drm_crtc_mask(&drm_if->crtc);
 
 	/* Register 'mode_set' function to operate prior to bridge */
-	drm_encoder_helper_add(&drm_if->pipe.encoder, &fl2000_encoder_funcs);
+	drm_encoder_helper_add(&drm_if->encoder, &fl2000_encoder_funcs);
 
 	/* Start streaming interface */
-	drm_if->stream = fl2000_stream_create(usb_dev, &drm_if->pipe.crtc);
+	drm_if->stream = fl2000_stream_create(usb_dev, &drm_if->crtc);
 
 	/* Start interrupts interface */
 	drm_if->intr = fl2000_intr_create(usb_dev, drm);
 
 	/* Attach bridge */
-	ret = component_bind_all(master, &drm_if->pipe);
+	ret = component_bind_all(master, &drm_if->encoder);
 	if (ret) {
 		dev_err(drm->dev, "Cannot attach bridge (%d)", ret);
 		return ret;
@@ -511,9 +1449,20 @@ int fl2000_drm_bind(struct device *master)
 		return ret;
 	}
 
+	/* Hardware frame counter is 16-bit, driver extends it to 32 bits */
+	drm_crtc_set_max_vblank_count(&drm_if->crtc, U32_MAX);
+
 	drm_kms_helper_poll_init(drm);
 
-	drm_plane_enable_fb_damage_clips(&drm_if->pipe.plane);
+	drm_plane_enable_fb_damage_clips(&drm_if->plane);
+	drm_plane_enable_fb_damage_clips(&drm_if->overlay);
+
+	fl2000_reset(usb_dev);
+	fl2000_usb_magic(usb_dev);
+
+	/* Stream buffers are replaced only while nobody may set a mode */
+	if (prealloc)
+		fl2000_prealloc_buffers(drm_if);
 
 	ret = drm_dev_register(drm, 0);
 	if (ret) {
@@ -521,9 +1470,6 @@ int fl2000_drm_bind(struct device *master)
 		return ret;
 	}
 
-	fl2000_reset(usb_dev);
-	fl2000_usb_magic(usb_dev);
-
 	drm_fbdev_generic_setup(drm, FL2000_FB_BPP);
 
 	return 0;
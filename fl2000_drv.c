@@ -194,7 +194,24 @@ static struct usb_driver fl2000_driver = {
 	.disable_hub_initiated_lpm = true,
 };
 
-module_usb_driver(fl2000_driver);
+static int __init fl2000_init(void)
+{
+	int ret;
+
+	/* Not critical: generic pixel conversion is used if kernels cannot be benchmarked */
+	ret = fl2000_conv_init();
+	if (ret)
+		pr_warn("Cannot select pixel conversion kernels (%d)", ret);
+
+	return usb_register(&fl2000_driver);
+}
+module_init(fl2000_init);
+
+static void __exit fl2000_exit(void)
+{
+	usb_deregister(&fl2000_driver);
+}
+module_exit(fl2000_exit);
 
 MODULE_AUTHOR("Artem Mygaiev");
 MODULE_DESCRIPTION("FL2000 USB display driver");
@@ -19,6 +19,13 @@ struct fl2000_intr {
 	struct workqueue_struct *work_queue;
 };
 
+/* Sink events may also be found by other status register readers, which pass them here */
+void fl2000_intr_sink_event(struct fl2000_intr *intr)
+{
+	if (!IS_ERR_OR_NULL(intr))
+		drm_kms_helper_hotplug_event(intr->drm);
+}
+
 static void fl2000_intr_work(struct work_struct *work)
 {
 	int event;
@@ -26,7 +33,7 @@ static void fl2000_intr_work(struct work_struct *work)
 
 	event = fl2000_check_interrupt(intr->usb_dev);
 	if (event)
-		drm_kms_helper_hotplug_event(intr->drm);
+		fl2000_intr_sink_event(intr);
 }
 
 static void fl2000_intr_release(struct device *dev, void *res)
@@ -181,6 +181,19 @@ int fl2000_set_pixfmt(struct usb_device *usb_dev, u32 bytes_pix)
 	return 0;
 }
 
+/* Output lines are reflected horizontally by the device */
+int fl2000_set_mirror(struct usb_device *usb_dev, bool mirror)
+{
+	struct regmap *regmap = dev_get_regmap(&usb_dev->dev, NULL);
+	union fl2000_vga_cntrl_reg_pxclk pxclk = { .val = 0 };
+	u32 mask = 0;
+
+	pxclk.mirror_mode = mirror;
+	fl2000_add_bitmask(mask, union fl2000_vga_cntrl_reg_pxclk, mirror_mode);
+
+	return regmap_write_bits(regmap, FL2000_VGA_CTRL_REG_PXCLK, mask, pxclk.val);
+}
+
 int fl2000_set_transfers(struct usb_device *usb_dev)
 {
 	struct regmap *regmap = dev_get_regmap(&usb_dev->dev, NULL);
@@ -328,6 +341,24 @@ int fl2000_check_interrupt(struct usb_device *usb_dev)
 	return sink_event;
 }
 
+/* Status register is precious: reading it clears sink events, so they are reported to the caller
+ * same as by interrupt check
+ */
+int fl2000_get_frame_cnt(struct usb_device *usb_dev, u32 *frame_cnt)
+{
+	struct regmap *regmap = dev_get_regmap(&usb_dev->dev, NULL);
+	union fl2000_vga_status_reg status;
+	int ret;
+
+	ret = regmap_read(regmap, FL2000_VGA_STATUS_REG, &status.val);
+	if (ret)
+		return ret;
+
+	*frame_cnt = status.frame_cnt;
+
+	return status.hdmi_event || status.monitor_event || status.edid_event;
+}
+
 int fl2000_i2c_dword(struct usb_device *usb_dev, bool read, u16 addr, u8 offset, u32 *data)
 {
 	int ret;
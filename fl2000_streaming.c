@@ -21,50 +21,280 @@
 #define FL2000_SB_MIN 3
 #define FL2000_SB_NUM (FL2000_SB_MIN + 1)
 
+/* Frames are transmitted in slices, each one with its own URB, so that transmission of a frame
+ * starts as soon as its first slice is converted. Slice size is a multiple of bulk max packet
+ * size, so the device sees continuous stream of packets and only the end of frame is marked with
+ * a short or zero length packet
+ */
+#define FL2000_SLICE_SIZE SZ_256K
+
+/* Slices kept in flight so that there are no gaps on the wire */
+#define FL2000_URB_NUM 8
+
 #define FL2000_URB_TIMEOUT 100
 
+/* Stream buffers are kept across mode changes and reused while they are large enough. Buffer
+ * capacity is rounded up to a size class, so that similar modes share buffers
+ */
+#define FL2000_SB_SIZE_CLASS SZ_1M
+
+/* Frame buffers in wire format are transmitted directly from their pages. Wrapping them into
+ * stream buffers maps them for DMA, so a few are cached for flipping between the same ones
+ */
+#define FL2000_XB_NUM 4
+
+/* Number of frames for which damage is remembered. Buffers older than that are fully converted */
+#define FL2000_DAMAGE_HISTORY FL2000_SB_NUM
+
+/* Limit time spent with preemption disabled by SIMD conversion kernels */
+#define FL2000_CONV_LINES 64
+
+/* Planes rotated by 90 or 270 degrees are read across frame buffer lines. Lines are then composed
+ * in tiles, so that frame buffer lines read for one line are still cached for the next ones
+ */
+#define FL2000_CONV_TILE 64
+
+/* Frame is converted in bands of lines by renderer and a pool of workers, unless damaged region
+ * is too small to benefit from that
+ */
+#define FL2000_CONV_WORKERS	3
+#define FL2000_CONV_BANDS	64
+#define FL2000_CONV_PAR_PIXELS	(256 * 1024)
+
+/* Frames are transmitted in the order they are rendered by default. For interactive use latency
+ * matters more than smoothness: only the newest frame is transmitted then, and frames it
+ * supersedes are recycled without being transmitted
+ */
+static bool mailbox;
+module_param(mailbox, bool, 0644);
+MODULE_PARM_DESC(mailbox, "Transmit only the newest rendered frame, dropping older ones");
+
+/* Each buffer journey: free->render->ready->busy->free->... Every state has a single owner, and
+ * ownership is passed with atomic state transitions, so no locking is needed:
+ *  - FREE:   nobody, may be claimed for rendering
+ *  - RENDER: frame is being converted into the buffer
+ *  - READY:  transmitter, frame waits for transmission. Renderer may still convert the frame,
+ *            only the part that is already converted is transmitted
+ *  - BUSY:   USB core, frame is being transmitted. Any positive state is a number of URBs
+ *            referencing the buffer: unchanged frame is repeated by reference, without copying
+ */
+enum fl2000_sb_state {
+	FL2000_SB_READY = -2,
+	FL2000_SB_RENDER = -1,
+	FL2000_SB_FREE = 0,
+	FL2000_SB_BUSY = 1,
+};
+
 struct fl2000_stream_buf {
-	struct list_head list;
-	struct sg_table sgt;
+	atomic_t state;
+	atomic_t converted; /* Bytes of the frame that are final */
 	struct page **pages;
+	struct sg_table sgt; /* Mapped for DMA once on allocation */
+	struct device *dma_dev;
+	bool need_sync;
 	unsigned int nr_pages;
 	void *vaddr;
+	size_t start; /* Frame offset in the buffer, wrapped frame buffers may be panned */
+	u32 frame; /* Number of the frame buffer contents correspond to, 0 if contents invalid */
+	bool mirror; /* Frame is composed for the device reflecting lines */
+};
+
+/* URBs are not tied to buffers, so the same frame may be in flight several times. Each URB gets
+ * its own SG list for a slice, pointing to DMA mapping of the buffer
+ */
+struct fl2000_stream_urb {
+	struct urb *urb;
+	struct sg_table sgt;
+	struct fl2000_stream_buf *sb; /* Buffer being transmitted */
+	bool eof; /* Last slice of the frame */
+	struct fl2000_stream *stream;
+	struct list_head idle;
+};
+
+struct fl2000_stream;
+
+/* Conversion of one frame, shared by renderer and workers */
+struct fl2000_conv_job {
+	struct fl2000_stream_buf *sb;
+	struct fl2000_plane planes[FL2000_PLANE_NUM];
+	unsigned int num_planes;
+	struct drm_rect rect;
+	bool tiled; /* Some plane is read across its lines */
+	size_t limit; /* Progress never goes beyond, clips converted later start there */
+	unsigned int band_lines;
+	unsigned int bands;
+	atomic_t next; /* Next band to convert */
+	DECLARE_BITMAP(done, FL2000_CONV_BANDS);
+	unsigned int published; /* Bands visible to transmitter, only renderer changes it */
+	wait_queue_head_t wq;
+};
+
+struct fl2000_conv_worker {
+	struct work_struct work;
+	struct fl2000_stream *stream;
 };
 
 struct fl2000_stream {
 	struct usb_device *usb_dev;
+	struct device *dma_dev; /* Host controller device, NULL if it does not use DMA */
+	int node; /* Stream buffers are allocated on the host controller node... */
+	gfp_t gfp_zone; /* ...and in the zone it reaches without bouncing */
+	atomic_t bounced; /* Stream buffers out of host controller DMA reach */
+	atomic_t dropped; /* Frames not rendered for lack of a buffer */
+	atomic_t superseded; /* Rendered frames replaced by newer ones before transmission */
 	struct drm_crtc *crtc;
-	/* Each buffer journey: render->transmit->wait->... */
-	struct list_head render_list;
-	struct list_head transmit_list;
-	struct list_head wait_list;
-	spinlock_t list_lock; /* List access from bh and interrupt contexts */
+	struct fl2000_stream_buf *sb[FL2000_SB_NUM];
+	struct fl2000_stream_buf *xb[FL2000_XB_NUM]; /* Wrapped frame buffers, set under tx_lock */
+	struct fl2000_stream_urb surb[FL2000_URB_NUM];
+	wait_queue_head_t free_wq;
 	size_t buf_size;
+	size_t buf_cap; /* Capacity of pooled stream buffers */
 	u32 bytes_pix;
+	unsigned int width;
+	unsigned int height;
+	/* Damage tracking: stream buffers that are 'older' than the newest one get missing updates
+	 * copied from the newest one, using history of damaged regions. Only renderer changes these
+	 */
+	struct fl2000_stream_buf *newest;
+	u32 frame;
+	bool mirror; /* Frames rendered from now on are composed for reflecting device */
+	struct drm_rect damage[FL2000_DAMAGE_HISTORY];
+	struct drm_rect pending; /* Damage of frames that were dropped */
+	struct fl2000_conv_job job;
+	struct fl2000_conv_worker conv_worker[FL2000_CONV_WORKERS];
+	struct workqueue_struct *conv_wq;
+	/* Transmitter: frame being transmitted and offset of its next slice. Transmission is driven
+	 * by URB completions, and by renderer when URBs wait for slices to be converted
+	 */
+	spinlock_t tx_lock;
+	struct fl2000_stream_buf *tx_sb;
+	size_t tx_start; /* Frame offset in the buffer being transmitted */
+	size_t tx_off;
+	struct scatterlist *tx_sg; /* DMA segment and offset in it corresponding to tx_off */
+	size_t tx_sg_off;
+	struct list_head idle; /* URBs waiting for a slice to transmit */
+	/* The work does what cannot be done in completion: halt clearing, submit retry */
 	struct work_struct work;
 	struct workqueue_struct *work_queue;
-	struct semaphore work_sem;
+	atomic_t halted; /* Bulk endpoint stalled, halt to be cleared by the work */
+	bool tx_mirror; /* Device reflects lines, switched by the work with the first such frame */
+	atomic_t mirror_pending;
 	bool enabled;
 	struct usb_anchor anchor;
 };
 
 static void fl2000_free_sb(struct fl2000_stream_buf *sb)
 {
-	vunmap(sb->vaddr);
+	if (sb->dma_dev)
+		dma_unmap_sgtable(sb->dma_dev, &sb->sgt, DMA_TO_DEVICE, DMA_ATTR_SKIP_CPU_SYNC);
 
 	sg_free_table(&sb->sgt);
 
+	if (is_vmalloc_addr(sb->vaddr))
+		vunmap(sb->vaddr);
+
+	/* Own pages are freed, wrapped ones are only released */
 	for (int i = 0; i < sb->nr_pages && sb->pages[i]; i++)
-		__free_page(sb->pages[i]);
+		put_page(sb->pages[i]);
 
 	kfree(sb->pages);
 
 	kfree(sb);
 }
 
-static struct fl2000_stream_buf *fl2000_alloc_sb(unsigned int size)
+/* Allocate buffer in as few physically contiguous chunks as possible, so that SG lists of URBs
+ * collapse into few large segments. High order allocations fail fast instead of going into
+ * reclaim, and order is lowered then. Chunks are split, so every page is freed on its own
+ */
+static int fl2000_alloc_sb_pages(struct fl2000_stream *stream, struct fl2000_stream_buf *sb)
+{
+	unsigned int order = min_t(unsigned int, ilog2(sb->nr_pages), MAX_ORDER);
+	unsigned int i = 0;
+	gfp_t zone = stream->gfp_zone;
+
+	while (i < sb->nr_pages) {
+		gfp_t gfp = GFP_KERNEL | zone;
+		struct page *page;
+
+		order = min_t(unsigned int, order, ilog2(sb->nr_pages - i));
+		if (order || zone)
+			gfp |= __GFP_NORETRY | __GFP_NOWARN;
+
+		page = alloc_pages_node(stream->node, gfp, order);
+		if (!page) {
+			if (order) {
+				order--;
+				continue;
+			}
+			/* Pages out of host controller reach still work, through bounce buffers */
+			if (!zone)
+				return -ENOMEM;
+			zone = 0;
+			continue;
+		}
+
+		split_page(page, order);
+		for (unsigned int j = 0; j < (1U << order); j++)
+			sb->pages[i++] = nth_page(page, j);
+	}
+
+	return 0;
+}
+
+/* With no IOMMU in between, host controller reaches pages beyond its DMA mask only through
+ * bounce buffers, which costs an extra copy of every frame
+ */
+static bool fl2000_sb_bounced(struct fl2000_stream_buf *sb, struct device *dma_dev)
+{
+	u64 limit = min_not_zero(dma_get_mask(dma_dev), dma_dev->bus_dma_limit);
+
+	if (device_iommu_mapped(dma_dev))
+		return false;
+
+	for (unsigned int i = 0; i < sb->nr_pages; i++)
+		if (page_to_phys(sb->pages[i]) + PAGE_SIZE - 1 > limit)
+			return true;
+
+	return false;
+}
+
+static bool fl2000_sb_contiguous(struct fl2000_stream_buf *sb)
+{
+	for (unsigned int i = 1; i < sb->nr_pages; i++)
+		if (page_to_pfn(sb->pages[i]) != page_to_pfn(sb->pages[0]) + i)
+			return false;
+
+	return true;
+}
+
+/* Map buffer for DMA once, so that USB core does not map and unmap it on every transmission */
+static int fl2000_map_sb(struct fl2000_stream_buf *sb, struct device *dma_dev)
 {
 	int ret;
+	struct scatterlist *sg;
+	int i;
+
+	ret = sg_alloc_table_from_pages_segment(&sb->sgt, sb->pages, sb->nr_pages, 0,
+						(size_t)sb->nr_pages << PAGE_SHIFT,
+						dma_get_max_seg_size(dma_dev), GFP_KERNEL);
+	if (ret)
+		return ret;
+
+	/* Contents are not valid yet, they are synced for device once converted */
+	ret = dma_map_sgtable(dma_dev, &sb->sgt, DMA_TO_DEVICE, DMA_ATTR_SKIP_CPU_SYNC);
+	if (ret)
+		return ret;
+
+	sb->dma_dev = dma_dev;
+
+	for_each_sgtable_dma_sg(&sb->sgt, sg, i)
+		sb->need_sync |= dma_need_sync(dma_dev, sg_dma_address(sg));
+
+	return 0;
+}
+
+static struct fl2000_stream_buf *fl2000_alloc_sb(struct fl2000_stream *stream, size_t size)
+{
 	struct fl2000_stream_buf *sb;
 	unsigned int nr_pages = PAGE_ALIGN(size) >> PAGE_SHIFT;
 
@@ -78,22 +308,74 @@ static struct fl2000_stream_buf *fl2000_alloc_sb(unsigned int size)
 	if (!sb->pages)
 		goto error;
 
-	for (int i = 0; i < nr_pages; i++) {
-		sb->pages[i] = alloc_page(GFP_KERNEL);
-		if (!sb->pages[i])
+	if (fl2000_alloc_sb_pages(stream, sb))
+		goto error;
+
+	/* Linear mapping of a single chunk uses large pages, so conversion has fewer TLB misses */
+	if (fl2000_sb_contiguous(sb))
+		sb->vaddr = page_address(sb->pages[0]);
+	else
+		sb->vaddr = vmap(sb->pages, nr_pages, VM_MAP, PAGE_KERNEL);
+	if (!sb->vaddr)
+		goto error;
+
+	if (stream->dma_dev) {
+		if (fl2000_map_sb(sb, stream->dma_dev))
 			goto error;
+
+		if (fl2000_sb_bounced(sb, stream->dma_dev)) {
+			dev_warn_once(&stream->usb_dev->dev, "Stream buffer needs bounce buffers");
+			atomic_inc(&stream->bounced);
+		}
 	}
 
-	ret = sg_alloc_table_from_pages(&sb->sgt, sb->pages, nr_pages, 0, size, GFP_KERNEL);
-	if (ret != 0)
+	/* Contents are not zeroed here, buffer is cleared when it is fully rendered */
+	atomic_set(&sb->state, FL2000_SB_FREE);
+
+	return sb;
+
+error:
+	fl2000_free_sb(sb);
+
+	return NULL;
+}
+
+/* Wrap frame buffer pages into a stream buffer. Pages are referenced, so they stay valid even if
+ * frame buffer goes away while its frame is still transmitted
+ */
+static struct fl2000_stream_buf *fl2000_wrap_sb(struct fl2000_stream *stream, struct page **pages,
+					       unsigned int nr_pages)
+{
+	struct fl2000_stream_buf *sb;
+
+	sb = kzalloc(sizeof(*sb), GFP_KERNEL);
+	if (!sb)
+		return NULL;
+
+	sb->pages = kmemdup(pages, nr_pages * sizeof(*pages), GFP_KERNEL);
+	if (!sb->pages)
 		goto error;
 
+	sb->nr_pages = nr_pages;
+	for (unsigned int i = 0; i < nr_pages; i++)
+		get_page(sb->pages[i]);
+
+	/* Own mapping, the newest frame is a reference for damage tracking */
 	sb->vaddr = vmap(sb->pages, nr_pages, VM_MAP, PAGE_KERNEL);
 	if (!sb->vaddr)
 		goto error;
 
-	INIT_LIST_HEAD(&sb->list);
-	memset(sb->vaddr, 0, nr_pages << PAGE_SHIFT);
+	if (stream->dma_dev) {
+		if (fl2000_map_sb(sb, stream->dma_dev))
+			goto error;
+
+		if (fl2000_sb_bounced(sb, stream->dma_dev))
+			atomic_inc(&stream->bounced);
+	}
+
+	/* Frame buffer contents are final at any time */
+	atomic_set(&sb->converted, stream->buf_size);
+	atomic_set(&sb->state, FL2000_SB_FREE);
 
 	return sb;
 
@@ -103,32 +385,77 @@ error:
 	return NULL;
 }
 
+static void fl2000_stream_put_wrapped(struct fl2000_stream *stream)
+{
+	for (int i = 0; i < FL2000_XB_NUM; i++) {
+		if (stream->xb[i])
+			fl2000_free_sb(stream->xb[i]);
+		stream->xb[i] = NULL;
+	}
+}
+
+static void fl2000_stream_data_completion(struct urb *urb);
+
 static void fl2000_stream_put_buffers(struct fl2000_stream *stream)
 {
-	struct fl2000_stream_buf *cur_sb;
-	struct fl2000_stream_buf *temp_sb;
+	for (int i = 0; i < FL2000_URB_NUM; i++) {
+		struct fl2000_stream_urb *surb = &stream->surb[i];
+
+		usb_free_urb(surb->urb);
+		surb->urb = NULL;
+		sg_free_table(&surb->sgt);
+	}
 
-	list_for_each_entry_safe(cur_sb, temp_sb, &stream->render_list, list) {
-		list_del(&cur_sb->list);
-		fl2000_free_sb(cur_sb);
+	for (int i = 0; i < FL2000_SB_NUM; i++) {
+		if (stream->sb[i])
+			fl2000_free_sb(stream->sb[i]);
+		stream->sb[i] = NULL;
 	}
 }
 
-static int fl2000_stream_get_buffers(struct fl2000_stream *stream, unsigned int size)
+static int fl2000_stream_get_buffers(struct fl2000_stream *stream, size_t size)
 {
 	int ret;
-	struct fl2000_stream_buf *cur_sb;
+	struct usb_device *usb_dev = stream->usb_dev;
 
-	BUG_ON(!list_empty(&stream->render_list));
+	BUILD_BUG_ON(!IS_ALIGNED(FL2000_SLICE_SIZE, PAGE_SIZE));
 
 	for (int i = 0; i < FL2000_SB_NUM; i++) {
-		cur_sb = fl2000_alloc_sb(size);
-		if (!cur_sb) {
+		BUG_ON(stream->sb[i]);
+
+		stream->sb[i] = fl2000_alloc_sb(stream, size);
+		if (!stream->sb[i]) {
 			ret = -ENOMEM;
 			goto error;
 		}
+	}
+
+	for (int i = 0; i < FL2000_URB_NUM; i++) {
+		struct fl2000_stream_urb *surb = &stream->surb[i];
+
+		BUG_ON(surb->urb);
 
-		list_add(&cur_sb->list, &stream->render_list);
+		surb->urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!surb->urb) {
+			ret = -ENOMEM;
+			goto error;
+		}
+
+		/* Large enough to hold SG list of any slice */
+		ret = sg_alloc_table(&surb->sgt, FL2000_SLICE_SIZE >> PAGE_SHIFT, GFP_KERNEL);
+		if (ret)
+			goto error;
+
+		/* Endpoint 1 bulk out. Data is passed with SG list only, which is filled in on
+		 * every submission together with length, the rest of URB configuration is static
+		 */
+		surb->stream = stream;
+		usb_fill_bulk_urb(surb->urb, usb_dev, usb_sndbulkpipe(usb_dev, 1), NULL, 0,
+				  fl2000_stream_data_completion, surb);
+		surb->urb->interval = 0;
+		surb->urb->sg = surb->sgt.sgl;
+		if (stream->dma_dev)
+			surb->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 	}
 
 	return 0;
@@ -145,220 +472,1008 @@ static void fl2000_stream_release(struct device *dev, void *res)
 	UNUSED(dev);
 
 	fl2000_stream_disable(stream);
-	destroy_workqueue(stream->work_queue);
+	if (stream->work_queue)
+		destroy_workqueue(stream->work_queue);
+	if (stream->conv_wq)
+		destroy_workqueue(stream->conv_wq);
+	fl2000_stream_put_wrapped(stream);
 	fl2000_stream_put_buffers(stream);
 }
 
-static void fl2000_stream_data_completion(struct urb *urb)
+static bool fl2000_sb_move(struct fl2000_stream_buf *sb, enum fl2000_sb_state from,
+			   enum fl2000_sb_state to)
 {
-	struct fl2000_stream_buf *cur_sb = urb->transfer_buffer;
-	struct usb_device *usb_dev = urb->dev;
-	struct fl2000_stream *stream = urb->context;
+	return atomic_cmpxchg(&sb->state, from, to) == from;
+}
+
+/* Claim a free buffer for rendering, pool may be empty if it could not be allocated. The newest
+ * buffer is never claimed since it is a reference for the other ones. Frames waiting for
+ * transmission are recycled only if nobody transmits them, or in mailbox mode, where the frame
+ * being rendered supersedes them anyway
+ */
+static struct fl2000_stream_buf *fl2000_stream_claim(struct fl2000_stream *stream)
+{
+	struct fl2000_stream_buf *newest = READ_ONCE(stream->newest);
+	bool enabled = READ_ONCE(stream->enabled);
+
+	for (int i = 0; i < FL2000_SB_NUM; i++) {
+		struct fl2000_stream_buf *sb = stream->sb[i];
+
+		if (sb && sb != newest && fl2000_sb_move(sb, FL2000_SB_FREE, FL2000_SB_RENDER))
+			return sb;
+	}
+
+	if (enabled && !READ_ONCE(mailbox))
+		return NULL;
+
+	for (int i = 0; i < FL2000_SB_NUM; i++) {
+		struct fl2000_stream_buf *sb = stream->sb[i];
+
+		if (!sb || sb == newest || !fl2000_sb_move(sb, FL2000_SB_READY, FL2000_SB_RENDER))
+			continue;
+
+		if (enabled)
+			atomic_inc(&stream->superseded);
+		return sb;
+	}
+
+	return NULL;
+}
+
+/* Oldest frame waiting for transmission goes first, either converted or wrapped one. In mailbox
+ * mode the newest one goes, and the older ones are recycled right away
+ */
+static struct fl2000_stream_buf *fl2000_stream_next(struct fl2000_stream *stream)
+{
+	struct fl2000_stream_buf *next = NULL;
+	bool newest_first = READ_ONCE(mailbox);
+	bool recycled = false;
+
+	for (int i = 0; i < FL2000_SB_NUM + FL2000_XB_NUM; i++) {
+		struct fl2000_stream_buf *sb = (i < FL2000_SB_NUM) ? stream->sb[i] :
+						stream->xb[i - FL2000_SB_NUM];
+		s32 age;
 
-	if (stream) {
-		spin_lock_irq(&stream->list_lock);
-		list_move_tail(&cur_sb->list, &stream->render_list);
-		spin_unlock(&stream->list_lock);
+		if (!sb || atomic_read_acquire(&sb->state) != FL2000_SB_READY)
+			continue;
 
-		drm_crtc_handle_vblank(stream->crtc);
+		age = next ? (s32)(sb->frame - next->frame) : 0;
+		if (!next || (newest_first ? age > 0 : age < 0))
+			next = sb;
+	}
+
+	if (next && !fl2000_sb_move(next, FL2000_SB_READY, FL2000_SB_BUSY))
+		return NULL;
+
+	/* Renderer may queue newer frames meanwhile, those are left for the next transmission */
+	for (int i = 0; next && newest_first && i < FL2000_SB_NUM + FL2000_XB_NUM; i++) {
+		struct fl2000_stream_buf *sb = (i < FL2000_SB_NUM) ? stream->sb[i] :
+						stream->xb[i - FL2000_SB_NUM];
+
+		if (!sb || sb == next || atomic_read_acquire(&sb->state) != FL2000_SB_READY ||
+		    (s32)(sb->frame - next->frame) > 0)
+			continue;
+
+		if (fl2000_sb_move(sb, FL2000_SB_READY, FL2000_SB_FREE)) {
+			atomic_inc(&stream->superseded);
+			recycled = true;
+		}
+	}
+
+	if (recycled)
+		wake_up(&stream->free_wq);
+
+	return next;
+}
+
+/* Take one more reference to the newest frame to transmit it again. Renderer may replace the
+ * newest buffer and reclaim the old one meanwhile, then the new newest one is taken
+ */
+static struct fl2000_stream_buf *fl2000_stream_resend(struct fl2000_stream *stream)
+{
+	struct fl2000_stream_buf *newest;
+
+	while ((newest = smp_load_acquire(&stream->newest))) {
+		if (atomic_inc_unless_negative(&newest->state))
+			return newest;
+
+		if (fl2000_sb_move(newest, FL2000_SB_READY, FL2000_SB_BUSY))
+			return newest;
+	}
+
+	return NULL;
+}
+
+static void fl2000_sb_put(struct fl2000_stream *stream, struct fl2000_stream_buf *sb)
+{
+	if (atomic_dec_return_release(&sb->state) == FL2000_SB_FREE)
+		wake_up(&stream->free_wq);
+}
 
-		/* Kick transmit workqueue */
-		up(&stream->work_sem);
+/* Advance DMA segment and offset in it, until the offset is within the segment */
+static void fl2000_sg_seek(struct scatterlist **pos, size_t *pos_off)
+{
+	while (*pos_off >= sg_dma_len(*pos)) {
+		*pos_off -= sg_dma_len(*pos);
+		*pos = sg_next(*pos);
+	}
+}
 
-		fl2000_urb_status(usb_dev, urb->status, urb->pipe);
+/* Point URB to a slice of the buffer mapped for DMA. Slice starts at the given DMA segment and
+ * offset in it, which are advanced to the end of the slice
+ */
+static void fl2000_stream_urb_set_dma(struct fl2000_stream_urb *surb, struct fl2000_stream_buf *sb,
+				      struct scatterlist **pos, size_t *pos_off, size_t len)
+{
+	struct scatterlist *s = *pos;
+	struct scatterlist *d = NULL;
+	size_t off = *pos_off;
+	unsigned int nents = 0;
+
+	surb->urb->transfer_buffer_length = len;
+
+	while (len) {
+		size_t n = min_t(size_t, sg_dma_len(s) - off, len);
+
+		d = d ? sg_next(d) : surb->sgt.sgl;
+		sg_unmark_end(d);
+		sg_dma_address(d) = sg_dma_address(s) + off;
+		sg_dma_len(d) = n;
+		d->length = n;
+		nents++;
+
+		len -= n;
+		off += n;
+		if (off == sg_dma_len(s)) {
+			s = sg_next(s);
+			off = 0;
+		}
 	}
+	sg_mark_end(d);
 
-	usb_free_urb(urb);
+	*pos = s;
+	*pos_off = off;
+
+	surb->sb = sb;
+	surb->urb->num_sgs = nents;
+	surb->urb->num_mapped_sgs = nents;
+}
+
+/* Point URB to a slice of the buffer, to be mapped by USB core. Buffer pages are shared,
+ * physically contiguous ones are merged into a single SG entry. Frame offset is page aligned, so
+ * a slice never spans more pages than the URB table holds
+ */
+static void fl2000_stream_urb_set(struct fl2000_stream_urb *surb, struct fl2000_stream_buf *sb,
+				  size_t off, size_t len)
+{
+	struct scatterlist *sg = NULL;
+	unsigned long pfn = 0;
+	unsigned int nents = 0;
+
+	surb->urb->transfer_buffer_length = len;
+
+	for (unsigned int i = off >> PAGE_SHIFT; len; i++) {
+		struct page *page = sb->pages[i];
+		unsigned int n = min_t(size_t, len, PAGE_SIZE);
+
+		if (sg && page_to_pfn(page) == pfn + 1) {
+			sg->length += n;
+		} else {
+			sg = sg ? sg_next(sg) : surb->sgt.sgl;
+			sg_unmark_end(sg);
+			sg_set_page(sg, page, n, 0);
+			nents++;
+		}
+
+		pfn = page_to_pfn(page);
+		len -= n;
+	}
+	sg_mark_end(sg);
+
+	surb->sb = sb;
+	surb->urb->num_sgs = nents;
+}
+
+/* Submit next slice of the frame being transmitted, starting the next frame if needed. Slices
+ * are submitted in order, so this is called with tx_lock held. Returns -EAGAIN if there is no
+ * converted slice to transmit yet
+ */
+static int fl2000_stream_tx(struct fl2000_stream *stream, struct fl2000_stream_urb *surb)
+{
+	int ret;
+	struct fl2000_stream_buf *sb = stream->tx_sb;
+	size_t off = stream->tx_off;
+	struct scatterlist *sg;
+	size_t sg_off;
+	size_t len;
+
+	/* If no buffers are available for immediate transmission - then repeat latest
+	 * transmission data
+	 */
+	if (!sb) {
+		sb = fl2000_stream_next(stream);
+		if (!sb)
+			sb = fl2000_stream_resend(stream);
+		if (!sb)
+			return -EAGAIN;
+
+		stream->tx_sb = sb;
+		stream->tx_start = READ_ONCE(sb->start);
+
+		/* Register write sleeps, so device is switched by the work right as the first frame
+		 * composed for the other mode goes out
+		 */
+		if (READ_ONCE(sb->mirror) != stream->tx_mirror) {
+			WRITE_ONCE(stream->tx_mirror, sb->mirror);
+			atomic_set(&stream->mirror_pending, 1);
+			queue_work(stream->work_queue, &stream->work);
+		}
+
+		stream->tx_off = off = 0;
+		stream->tx_sg = sb->sgt.sgl;
+		stream->tx_sg_off = stream->tx_start;
+		if (stream->dma_dev)
+			fl2000_sg_seek(&stream->tx_sg, &stream->tx_sg_off);
+	}
+
+	len = min_t(size_t, FL2000_SLICE_SIZE, stream->buf_size - off);
+	if (off + len > atomic_read_acquire(&sb->converted))
+		return -EAGAIN;
+
+	/* Transmitter holds one reference for the whole frame, and each URB one per slice */
+	atomic_inc(&sb->state);
+	sg = stream->tx_sg;
+	sg_off = stream->tx_sg_off;
+	if (stream->dma_dev)
+		fl2000_stream_urb_set_dma(surb, sb, &sg, &sg_off, len);
+	else
+		fl2000_stream_urb_set(surb, sb, stream->tx_start + off, len);
+
+	/* End of frame is marked with short or zero length packet */
+	surb->eof = (off + len == stream->buf_size);
+	if (surb->eof)
+		surb->urb->transfer_flags |= URB_ZERO_PACKET;
+	else
+		surb->urb->transfer_flags &= ~URB_ZERO_PACKET;
+
+	usb_anchor_urb(surb->urb, &stream->anchor);
+	ret = usb_submit_urb(surb->urb, GFP_ATOMIC);
+	if (ret) {
+		usb_unanchor_urb(surb->urb);
+		surb->sb = NULL;
+		fl2000_sb_put(stream, sb);
+		return ret;
+	}
+
+	stream->tx_off = off + len;
+	stream->tx_sg = sg;
+	stream->tx_sg_off = sg_off;
+	if (surb->eof) {
+		stream->tx_sb = NULL;
+		fl2000_sb_put(stream, sb);
+	}
+
+	return 0;
+}
+
+/* Submit as many slices as possible with idle URBs */
+static int fl2000_stream_kick(struct fl2000_stream *stream)
+{
+	int ret = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&stream->tx_lock, flags);
+	while (READ_ONCE(stream->enabled) && !list_empty(&stream->idle)) {
+		struct fl2000_stream_urb *surb = list_first_entry(&stream->idle,
+								  struct fl2000_stream_urb, idle);
+
+		ret = fl2000_stream_tx(stream, surb);
+		if (ret)
+			break;
+
+		list_del(&surb->idle);
+	}
+	spin_unlock_irqrestore(&stream->tx_lock, flags);
+
+	return (ret == -EAGAIN) ? 0 : ret;
+}
+
+static void fl2000_stream_data_completion(struct urb *urb)
+{
+	int ret;
+	unsigned long flags;
+	struct fl2000_stream_urb *surb = urb->context;
+	struct fl2000_stream *stream = surb->stream;
+	struct usb_device *usb_dev = urb->dev;
+	int status = urb->status;
+
+	fl2000_sb_put(stream, surb->sb);
+	surb->sb = NULL;
+
+	/* URB was killed or device is gone */
+	if (status == -ENOENT || status == -ECONNRESET || status == -ESHUTDOWN)
+		return;
+
+	if (status && status != -EPIPE)
+		fl2000_urb_status(usb_dev, status, urb->pipe);
+
+	/* Resubmit right from the completion so there is no gap on the wire. If the next slice is
+	 * not converted yet, URB waits for the renderer to kick it
+	 */
+	spin_lock_irqsave(&stream->tx_lock, flags);
+	if (READ_ONCE(stream->enabled) && status != -EPIPE)
+		ret = fl2000_stream_tx(stream, surb);
+	else
+		ret = -EAGAIN;
+	if (ret)
+		list_add_tail(&surb->idle, &stream->idle);
+	spin_unlock_irqrestore(&stream->tx_lock, flags);
+
+	if (ret == -ENODEV || ret == -ESHUTDOWN) {
+		WRITE_ONCE(stream->enabled, false);
+	} else if (status == -EPIPE || (ret && ret != -EAGAIN)) {
+		/* Clearing halt sleeps, leave it to the work together with resubmission */
+		if (status == -EPIPE)
+			atomic_set(&stream->halted, 1);
+		queue_work(stream->work_queue, &stream->work);
+	}
 }
 
-/* TODO: convert to tasklet */
 static void fl2000_stream_work(struct work_struct *work)
 {
 	int ret;
 	struct fl2000_stream *stream = container_of(work, struct fl2000_stream, work);
 	struct usb_device *usb_dev = stream->usb_dev;
-	struct fl2000_stream_buf *cur_sb;
-	struct fl2000_stream_buf *last_sb;
-	struct urb *data_urb;
-
-	while (stream->enabled) {
-		ret = down_interruptible(&stream->work_sem);
-		if (ret) {
-			dev_err(&usb_dev->dev, "Work interrupt error %d", ret);
-			stream->enabled = false;
-			return;
-		}
 
-		spin_lock_irq(&stream->list_lock);
+	if (atomic_xchg(&stream->halted, 0))
+		fl2000_urb_status(usb_dev, -EPIPE, usb_sndbulkpipe(usb_dev, 1));
 
-		/* If no buffers are available for immediate transmission - then copy latest
-		 * transmission data
-		 */
-		if (list_empty(&stream->transmit_list)) {
-			if (list_empty(&stream->wait_list))
-				last_sb = list_last_entry(&stream->render_list,
-							  struct fl2000_stream_buf, list);
-			else
-				last_sb = list_last_entry(&stream->wait_list,
-							  struct fl2000_stream_buf, list);
-			cur_sb = list_first_entry(&stream->render_list, struct fl2000_stream_buf,
-						  list);
-			memcpy(cur_sb->vaddr, last_sb->vaddr, stream->buf_size);
-		} else {
-			cur_sb = list_first_entry(&stream->transmit_list, struct fl2000_stream_buf,
-						  list);
+	if (atomic_xchg(&stream->mirror_pending, 0))
+		fl2000_set_mirror(usb_dev, READ_ONCE(stream->tx_mirror));
+
+	ret = fl2000_stream_kick(stream);
+	if (ret) {
+		dev_err(&usb_dev->dev, "Data URB error %d", ret);
+		WRITE_ONCE(stream->enabled, false);
+	}
+}
+
+/* Collect regions updated since the stream buffer contents were rendered. Returns false if the
+ * buffer is too old (or invalid) and shall be fully re-rendered
+ */
+static bool fl2000_stream_stale(struct fl2000_stream *stream, struct fl2000_stream_buf *sb,
+				struct drm_rect *stale)
+{
+	drm_rect_init(stale, 0, 0, 0, 0);
+
+	if (!stream->newest || !sb->frame || stream->frame - sb->frame >= FL2000_DAMAGE_HISTORY)
+		return false;
+
+	for (u32 frame = sb->frame + 1; frame != stream->frame + 1; frame++)
+		fl2000_rect_union(stale, &stream->damage[frame % FL2000_DAMAGE_HISTORY]);
+
+	return true;
+}
+
+/* Copy stale region from the newest buffer. Copied byte ranges are extended to 64-bit words so
+ * that swapped halves of boundary words are not lost; extra bytes are either equal in both
+ * buffers or overwritten afterwards by conversion
+ */
+static void fl2000_stream_copy_stale(struct fl2000_stream *stream, struct fl2000_stream_buf *sb,
+				     const struct drm_rect *stale)
+{
+	u8 *dst = sb->vaddr;
+	u8 *src = stream->newest->vaddr + stream->newest->start;
+	unsigned int line_len = stream->width * stream->bytes_pix;
+	size_t start, end;
+
+	/* Full lines can be copied in one go */
+	if (stale->x1 == 0 && stale->x2 == stream->width) {
+		start = (size_t)stale->y1 * line_len;
+		end = min_t(size_t, ALIGN((size_t)stale->y2 * line_len, 8), stream->buf_size);
+		memcpy(dst + start, src + start, end - start);
+		return;
+	}
+
+	for (int y = stale->y1; y < stale->y2; y++) {
+		start = ALIGN_DOWN((size_t)y * line_len + stale->x1 * stream->bytes_pix, 8);
+		end = ALIGN((size_t)y * line_len + stale->x2 * stream->bytes_pix, 8);
+		end = min(end, stream->buf_size);
+		memcpy(dst + start, src + start, end - start);
+	}
+}
+
+/* Make CPU writes to the buffer range visible to the device. IOMMU may merge physically
+ * discontiguous pages into one DMA segment, while syncing translates only the start of the range,
+ * so the range is synced in pieces contiguous both for DMA and in physical memory
+ */
+static void fl2000_sb_sync(struct fl2000_stream_buf *sb, size_t start, size_t end)
+{
+	struct scatterlist *cpu = sb->sgt.sgl;
+	struct scatterlist *dma = sb->sgt.sgl;
+	size_t cpu_off = 0;
+	size_t dma_off = 0;
+	size_t pos = 0;
+
+	if (!sb->need_sync)
+		return;
+
+	while (pos < end) {
+		size_t n = min_t(size_t, cpu->length - cpu_off, sg_dma_len(dma) - dma_off);
+		size_t skip = (start > pos) ? start - pos : 0;
+
+		n = min(n, end - pos);
+		if (skip < n)
+			dma_sync_single_range_for_device(sb->dma_dev, sg_dma_address(dma),
+							 dma_off + skip, n - skip, DMA_TO_DEVICE);
+
+		pos += n;
+		cpu_off += n;
+		dma_off += n;
+		if (cpu_off == cpu->length) {
+			cpu = sg_next(cpu);
+			cpu_off = 0;
 		}
-		list_move_tail(&cur_sb->list, &stream->wait_list);
-		spin_unlock(&stream->list_lock);
-
-		data_urb = usb_alloc_urb(0, GFP_KERNEL);
-		if (!data_urb) {
-			dev_err(&usb_dev->dev, "Data URB allocation error");
-			stream->enabled = false;
-			return;
+		if (dma_off == sg_dma_len(dma)) {
+			dma = sg_next(dma);
+			dma_off = 0;
 		}
+	}
+}
 
-		/* Endpoint 1 bulk out. We store pointer to current stream buffer structure in
-		 * transfer_buffer field of URB which is unused due to SGT
-		 */
-		usb_fill_bulk_urb(data_urb, usb_dev, usb_sndbulkpipe(usb_dev, 1), cur_sb,
-				  (int)stream->buf_size, fl2000_stream_data_completion, stream);
-		data_urb->interval = 0;
-		data_urb->sg = cur_sb->sgt.sgl;
-		data_urb->num_sgs = cur_sb->sgt.nents;
-		data_urb->transfer_flags |= URB_ZERO_PACKET;
-
-		usb_anchor_urb(data_urb, &stream->anchor);
-		ret = fl2000_submit_urb(data_urb);
-		if (ret) {
-			dev_err(&usb_dev->dev, "Data URB error %d", ret);
-			usb_free_urb(data_urb);
-			stream->enabled = false;
+/* Let transmitter send what is converted. Partially converted 64-bit word is not final yet */
+static void fl2000_stream_progress(struct fl2000_stream *stream, struct fl2000_stream_buf *sb,
+				   size_t converted)
+{
+	size_t prev = atomic_read(&sb->converted);
+
+	converted = ALIGN_DOWN(converted, 8);
+	if (converted <= prev)
+		return;
+
+	fl2000_sb_sync(sb, prev, converted);
+	atomic_set_release(&sb->converted, converted);
+	fl2000_stream_kick(stream);
+}
+
+/* Compose one line of the frame: line is split into segments, each one showing a single plane
+ * (the topmost opaque one there), possibly with a plane with alpha blended over it, or nothing.
+ * This way every wire pixel is produced from its sources at once
+ */
+static void fl2000_stream_compose_line(struct fl2000_stream *stream, struct fl2000_conv_job *job,
+				       const struct fl2000_conv *conv, int y, int x1, int x2)
+{
+	unsigned int line_off = y * stream->width * stream->bytes_pix;
+	int x = x1;
+
+	while (x < x2) {
+		const struct fl2000_plane *top = NULL;
+		const struct fl2000_plane *over = NULL;
+		unsigned int off = line_off + x * stream->bytes_pix;
+		int end = x2;
+
+		for (unsigned int i = 0; i < job->num_planes; i++) {
+			const struct fl2000_plane *plane = &job->planes[i];
+			const struct drm_rect *dst = &plane->dst;
+
+			if (y < dst->y1 || y >= dst->y2)
+				continue;
+
+			if (x >= dst->x1 && x < dst->x2) {
+				if (plane->format->has_alpha) {
+					over = plane;
+				} else {
+					top = plane;
+					over = NULL;
+				}
+				end = min(end, dst->x2);
+			} else if (dst->x1 > x) {
+				end = min(end, dst->x1);
+			}
+		}
+
+		if (over)
+			fl2000_conv_blend_line(conv, top, top ? x - top->dst.x1 : 0,
+					       top ? y - top->dst.y1 : 0, over, x - over->dst.x1,
+					       y - over->dst.y1, stream->bytes_pix, job->sb->vaddr,
+					       off, end - x);
+		else if (top)
+			fl2000_conv_line(conv, top, stream->bytes_pix, job->sb->vaddr, off,
+					 x - top->dst.x1, y - top->dst.y1, end - x);
+		else
+			fl2000_conv_zero(job->sb->vaddr, off, (end - x) * stream->bytes_pix);
+
+		x = end;
+	}
+}
+
+static void fl2000_stream_convert_lines(struct fl2000_stream *stream, struct fl2000_conv_job *job,
+					const struct drm_rect *rect)
+{
+	const struct fl2000_conv *conv = fl2000_conv_get(stream->bytes_pix);
+	int y = rect->y1;
+
+	while (y < rect->y2) {
+		int y_end = min(y + FL2000_CONV_LINES, rect->y2);
+
+		if (conv->begin)
+			conv->begin();
+
+		if (job->tiled) {
+			for (int x = rect->x1; x < rect->x2; x += FL2000_CONV_TILE)
+				for (int ty = y; ty < y_end; ty++)
+					fl2000_stream_compose_line(stream, job, conv, ty, x,
+								   min(x + FL2000_CONV_TILE,
+								       rect->x2));
+			y = y_end;
 		}
+
+		for (; y < y_end; y++)
+			fl2000_stream_compose_line(stream, job, conv, y, rect->x1, rect->x2);
+
+		if (conv->end)
+			conv->end();
 	}
 }
 
-static void fl2000_xrgb888_to_rgb888_line(u8 *dbuf, u32 *sbuf, u32 pixels)
+/* Publish contiguous run of converted bands. Only renderer calls this */
+static void fl2000_conv_job_publish(struct fl2000_stream *stream, struct fl2000_conv_job *job)
+{
+	unsigned int line_len = stream->width * stream->bytes_pix;
+	unsigned int band = job->published;
+	int y;
+
+	while (band < job->bands && test_bit_acquire(band, job->done))
+		band++;
+
+	if (band == job->published)
+		return;
+
+	/* Everything up to the damaged part of the first unconverted line is final */
+	job->published = band;
+	y = min_t(int, job->rect.y1 + band * job->band_lines, job->rect.y2);
+	if (y < job->rect.y2)
+		fl2000_stream_progress(stream, job->sb,
+				       min((size_t)y * line_len + job->rect.x1 * stream->bytes_pix,
+					   job->limit));
+	else
+		fl2000_stream_progress(stream, job->sb, job->limit);
+}
+
+/* Convert bands until there are none left. Bands are taken one by one from the shared counter,
+ * so faster CPUs convert more of them and a slow one does not hold up the frame
+ */
+static void fl2000_conv_job_run(struct fl2000_stream *stream, struct fl2000_conv_job *job,
+				bool renderer)
 {
-	unsigned int xx = 0;
+	unsigned int band;
 
-	for (unsigned int x = 0; x < pixels; x++) {
-		dbuf[xx++ ^ 4] = (sbuf[x] & 0x000000FF) >> 0;
-		dbuf[xx++ ^ 4] = (sbuf[x] & 0x0000FF00) >> 8;
-		dbuf[xx++ ^ 4] = (sbuf[x] & 0x00FF0000) >> 16;
+	while ((band = atomic_fetch_inc(&job->next)) < job->bands) {
+		struct drm_rect rect = job->rect;
+
+		rect.y1 += band * job->band_lines;
+		rect.y2 = min(rect.y1 + (int)job->band_lines, job->rect.y2);
+		fl2000_stream_convert_lines(stream, job, &rect);
+
+		smp_mb__before_atomic(); /* Band contents before done bit */
+		set_bit(band, job->done);
+
+		if (renderer)
+			fl2000_conv_job_publish(stream, job);
+		else
+			wake_up(&job->wq);
 	}
 }
 
-static void fl2000_xrgb888_to_rgb565_line(u16 *dbuf, u32 *sbuf, u32 pixels)
+static void fl2000_conv_work(struct work_struct *work)
 {
-	for (unsigned int x = 0; x < pixels; x++) {
-		u16 val565 = ((sbuf[x] & 0x00F80000) >> 8) | ((sbuf[x] & 0x0000FC00) >> 5) |
-			     ((sbuf[x] & 0x000000F8) >> 3);
-		dbuf[x ^ 2] = val565;
+	struct fl2000_conv_worker *worker = container_of(work, struct fl2000_conv_worker, work);
+
+	fl2000_conv_job_run(worker->stream, &worker->stream->job, false);
+}
+
+static void fl2000_stream_convert(struct fl2000_stream *stream, struct fl2000_stream_buf *sb,
+				  const struct fl2000_plane *planes, unsigned int num_planes,
+				  const struct drm_rect *rect, size_t limit)
+{
+	struct fl2000_conv_job *job = &stream->job;
+	unsigned int lines = drm_rect_height(rect);
+	unsigned int workers = 0;
+
+	if (!drm_rect_visible(rect))
+		return;
+
+	job->sb = sb;
+	memcpy(job->planes, planes, num_planes * sizeof(*planes));
+	job->num_planes = num_planes;
+	job->rect = *rect;
+	job->tiled = false;
+	for (unsigned int i = 0; i < num_planes; i++)
+		if (planes[i].rotation & (DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_270))
+			job->tiled = true;
+	job->limit = limit;
+	job->band_lines = max_t(unsigned int, FL2000_CONV_LINES,
+				DIV_ROUND_UP(lines, FL2000_CONV_BANDS));
+	job->bands = DIV_ROUND_UP(lines, job->band_lines);
+	job->published = 0;
+	atomic_set(&job->next, 0);
+	bitmap_zero(job->done, FL2000_CONV_BANDS);
+
+	/* Small regions are not worth waking other CPUs up */
+	if (drm_rect_width(rect) * lines >= FL2000_CONV_PAR_PIXELS)
+		workers = min_t(unsigned int, min(num_online_cpus(), job->bands) - 1,
+				FL2000_CONV_WORKERS);
+
+	for (unsigned int i = 0; i < workers; i++)
+		queue_work(stream->conv_wq, &stream->conv_worker[i].work);
+
+	/* Renderer converts as well, and then waits for bands that are still being converted */
+	fl2000_conv_job_run(stream, job, true);
+	while (job->published < job->bands) {
+		wait_event(job->wq, test_bit(job->published, job->done));
+		fl2000_conv_job_publish(stream, job);
 	}
+
+	/* Workers that did not get to run have nothing to do anymore */
+	for (unsigned int i = 0; i < workers; i++)
+		cancel_work_sync(&stream->conv_worker[i].work);
 }
 
-void fl2000_stream_compress(struct fl2000_stream *stream, void *src, unsigned int height,
-			    unsigned int width, unsigned int pitch)
+/* Clear frame padding, nothing is converted there. Range is extended to 64-bit word, conversion
+ * that follows overwrites extra bytes
+ */
+static void fl2000_stream_clear(struct fl2000_stream *stream, struct fl2000_stream_buf *sb)
 {
-	struct fl2000_stream_buf *cur_sb;
-	void *dst;
-	u32 dst_line_len;
+	u8 *dst = sb->vaddr;
+	size_t start = ALIGN_DOWN((size_t)stream->height * stream->width * stream->bytes_pix, 8);
 
-	BUG_ON(list_empty(&stream->render_list));
+	memset(dst + start, 0, stream->buf_size - start);
+}
 
-	spin_lock_irq(&stream->list_lock);
+void fl2000_stream_compress(struct fl2000_stream *stream, const struct fl2000_plane *planes,
+			    unsigned int num_planes, const struct drm_rect *clips,
+			    unsigned int num_clips)
+{
+	struct fl2000_stream_buf *cur_sb = NULL;
+	struct drm_rect damage[FL2000_CLIP_NUM + 1];
+	unsigned int num_damage = 0;
+	unsigned int line_len = stream->width * stream->bytes_pix;
+	struct drm_rect rect = {};
+	struct drm_rect stale;
+	struct drm_rect frame;
+
+	/* Mode is not set, or there are no buffers for it */
+	if (!stream->buf_size)
+		return;
+
+	/* Planes may not cover whole frame, uncovered parts are composed black */
+	drm_rect_init(&frame, 0, 0, stream->width, stream->height);
+
+	for (unsigned int i = 0; i < num_clips; i++)
+		fl2000_rect_union(&rect, &clips[i]);
+
+	/* Buffers are returned by transmission completions, so waiting is bounded */
+	if (!wait_event_timeout(stream->free_wq, (cur_sb = fl2000_stream_claim(stream)),
+				msecs_to_jiffies(FL2000_URB_TIMEOUT))) {
+		dev_warn_ratelimited(&stream->usb_dev->dev, "No stream buffer, frame dropped");
+		atomic_inc(&stream->dropped);
+		fl2000_rect_union(&stream->pending, &rect);
+		return;
+	}
 
-	cur_sb = list_first_entry(&stream->render_list, struct fl2000_stream_buf, list);
-	dst = cur_sb->vaddr;
-	dst_line_len = width * stream->bytes_pix;
+	/* Bring buffer up to date with the newest one and convert only what was damaged (including
+	 * damage of dropped frames), or convert everything if buffer age is unknown
+	 */
+	if (fl2000_stream_stale(stream, cur_sb, &stale)) {
+		if (drm_rect_intersect(&stale, &frame))
+			fl2000_stream_copy_stale(stream, cur_sb, &stale);
+		if (drm_rect_visible(&stream->pending))
+			damage[num_damage++] = stream->pending;
+		for (unsigned int i = 0; i < num_clips && i < FL2000_CLIP_NUM; i++)
+			damage[num_damage++] = clips[i];
+		fl2000_rect_union(&rect, &stream->pending);
+		drm_rect_intersect(&rect, &frame);
+	} else {
+		fl2000_stream_clear(stream, cur_sb);
+		damage[num_damage++] = frame;
+		rect = frame;
+	}
+	drm_rect_init(&stream->pending, 0, 0, 0, 0);
 
-	for (unsigned int y = 0; y < height; y++) {
-		switch (stream->bytes_pix) {
-		case 2:
-			fl2000_xrgb888_to_rgb565_line(dst, src, width);
-			break;
-		case 3:
-			fl2000_xrgb888_to_rgb888_line(dst, src, width);
-			break;
-		default: /* Shouldn't happen */
+	stream->frame++;
+	stream->damage[stream->frame % FL2000_DAMAGE_HISTORY] = rect;
+	WRITE_ONCE(cur_sb->frame, stream->frame);
+	WRITE_ONCE(cur_sb->mirror, stream->mirror);
+
+	/* Queue the frame for transmission before it is converted, so that its top is transmitted
+	 * while the bottom is still being converted
+	 */
+	atomic_set(&cur_sb->converted, 0);
+	atomic_set_release(&cur_sb->state, FL2000_SB_READY);
+
+	/* Clips are converted top to bottom, so that transmission may follow */
+	for (unsigned int i = 0; i < num_damage; i++)
+		if (!drm_rect_intersect(&damage[i], &frame))
+			damage[i--] = damage[--num_damage];
+
+	for (unsigned int i = 1; i < num_damage; i++)
+		for (unsigned int j = i; j > 0 && damage[j].y1 < damage[j - 1].y1; j--)
+			swap(damage[j], damage[j - 1]);
+
+	for (unsigned int i = 0; i < num_damage; i++) {
+		size_t limit = stream->buf_size;
+
+		for (unsigned int j = i + 1; j < num_damage; j++)
+			limit = min(limit, (size_t)damage[j].y1 * line_len +
+					   damage[j].x1 * stream->bytes_pix);
+
+		fl2000_stream_convert(stream, cur_sb, planes, num_planes, &damage[i], limit);
+	}
+	fl2000_stream_progress(stream, cur_sb, stream->buf_size);
+
+	/* Publish converted frame. It is ready before it becomes the newest one, so transmitter
+	 * taking the newest frame never finds it being rendered
+	 */
+	smp_store_release(&stream->newest, cur_sb);
+}
+
+/* Find frame buffer among wrapped ones, or wrap it in place of a buffer that is not in use */
+static struct fl2000_stream_buf *fl2000_stream_wrap(struct fl2000_stream *stream,
+						    struct page **pages, unsigned int nr_pages)
+{
+	struct fl2000_stream_buf *sb;
+	struct fl2000_stream_buf *old;
+	int victim = -1;
+
+	/* Wrapped pages are referenced, so they cannot be reused by another frame buffer */
+	for (int i = 0; i < FL2000_XB_NUM; i++) {
+		sb = stream->xb[i];
+		if (sb && sb->nr_pages == nr_pages &&
+		    !memcmp(sb->pages, pages, nr_pages * sizeof(*pages)))
+			return sb;
+	}
+
+	/* Free buffer that is not the newest one stays free: only ready or newest buffers are
+	 * taken for transmission
+	 */
+	for (int i = 0; i < FL2000_XB_NUM; i++) {
+		sb = stream->xb[i];
+		if (!sb) {
+			victim = i;
 			break;
 		}
-		src += pitch;
-		dst += dst_line_len;
+		if (sb == stream->newest || atomic_read(&sb->state) != FL2000_SB_FREE)
+			continue;
+		if (victim < 0 || (s32)(sb->frame - stream->xb[victim]->frame) < 0)
+			victim = i;
 	}
+	if (victim < 0)
+		return NULL;
+
+	sb = fl2000_wrap_sb(stream, pages, nr_pages);
+	if (!sb)
+		return NULL;
+
+	spin_lock_irq(&stream->tx_lock);
+	old = stream->xb[victim];
+	stream->xb[victim] = sb;
+	spin_unlock_irq(&stream->tx_lock);
+
+	if (old)
+		fl2000_free_sb(old);
 
-	list_move_tail(&cur_sb->list, &stream->transmit_list);
-	spin_unlock(&stream->list_lock);
+	return sb;
 }
 
-int fl2000_stream_mode_set(struct fl2000_stream *stream, int pixels, u32 bytes_pix)
+/* Queue wrapped frame buffer for transmission. Frame buffer that is already queued, or repeated as
+ * the newest one, has its update transmitted as it is. Transmission takes frame offset when it
+ * starts, so panning only changes what the next transmission sends
+ */
+static bool fl2000_stream_queue(struct fl2000_stream *stream, struct fl2000_stream_buf *sb,
+				size_t start)
 {
-	int ret;
-	unsigned int size;
+	int state = atomic_read(&sb->state);
 
-	/* Round buffer size up to multiple of 8 to meet HW expectations */
-	size = (pixels * bytes_pix + 7) & ~7U;
+	WRITE_ONCE(sb->start, start);
 
-	stream->bytes_pix = bytes_pix;
+	if (state == FL2000_SB_READY || (state > FL2000_SB_FREE && sb == stream->newest))
+		return true;
+
+	WRITE_ONCE(sb->frame, stream->frame + 1);
+
+	return fl2000_sb_move(sb, FL2000_SB_FREE, FL2000_SB_READY);
+}
+
+/**
+ * fl2000_stream_scanout() - transmit frame buffer without conversion
+ * @stream:	stream
+ * @pages:	frame buffer pages
+ * @nr_pages:	number of frame buffer pages
+ * @start:	frame offset in the frame buffer, frame is in wire format including padding
+ * @rect:	damaged region
+ *
+ * Frame buffer pages are transmitted directly. Frame buffer that is being transmitted may go
+ * through the next flip still being read, same as any other scanout buffer. Frame buffer larger
+ * than the frame is panned by moving the frame offset, which costs nothing
+ */
+void fl2000_stream_scanout(struct fl2000_stream *stream, struct page **pages,
+			   unsigned int nr_pages, size_t start, const struct drm_rect *rect)
+{
+	struct fl2000_stream_buf *sb;
+
+	if (!stream->buf_size)
+		return;
 
-	/* If there are buffers with same size - keep them */
-	if (stream->buf_size == size)
+	sb = fl2000_stream_wrap(stream, pages, nr_pages);
+	if (!sb) {
+		dev_warn_ratelimited(&stream->usb_dev->dev, "Cannot wrap frame buffer, dropped");
+		atomic_inc(&stream->dropped);
+		fl2000_rect_union(&stream->pending, rect);
+		return;
+	}
+
+	fl2000_sb_sync(sb, start, start + stream->buf_size);
+
+	WRITE_ONCE(sb->mirror, stream->mirror);
+
+	/* Buffer is busy only until its current transmission completes */
+	if (!wait_event_timeout(stream->free_wq, fl2000_stream_queue(stream, sb, start),
+				msecs_to_jiffies(FL2000_URB_TIMEOUT))) {
+		dev_warn_ratelimited(&stream->usb_dev->dev, "Frame buffer busy, frame dropped");
+		atomic_inc(&stream->dropped);
+		fl2000_rect_union(&stream->pending, rect);
+		return;
+	}
+
+	/* Converted buffers catch up with the whole frame, it is copied in wire format */
+	stream->frame++;
+	drm_rect_init(&stream->damage[stream->frame % FL2000_DAMAGE_HISTORY], 0, 0, stream->width,
+		      stream->height);
+	drm_rect_init(&stream->pending, 0, 0, 0, 0);
+
+	smp_store_release(&stream->newest, sb);
+	fl2000_stream_kick(stream);
+}
+
+/**
+ * fl2000_stream_reserve() - make pooled stream buffers large enough for a frame
+ * @stream:	stream
+ * @size:	frame size in bytes
+ *
+ * Buffers that are large enough are kept, otherwise they are replaced with buffers of the size
+ * class the frame belongs to. Stream shall be disabled
+ *
+ * Return: Operation result
+ */
+int fl2000_stream_reserve(struct fl2000_stream *stream, size_t size)
+{
+	int ret;
+	size_t capacity = ALIGN(size, FL2000_SB_SIZE_CLASS);
+
+	if (stream->buf_cap >= size)
 		return 0;
 
-	/* Destroy wrong size buffers if they exist */
-	if (!list_empty(&stream->render_list))
-		fl2000_stream_put_buffers(stream);
+	fl2000_stream_put_buffers(stream);
+	stream->buf_cap = 0;
 
-	/* Allocate new buffers */
-	ret = fl2000_stream_get_buffers(stream, size);
+	ret = fl2000_stream_get_buffers(stream, capacity);
 	if (ret) {
 		fl2000_stream_put_buffers(stream);
-		stream->buf_size = 0;
 		return ret;
 	}
 
-	stream->buf_size = size;
+	stream->buf_cap = capacity;
 
 	return 0;
 }
 
-int fl2000_stream_enable(struct fl2000_stream *stream)
+/* Frames rendered after this call are composed for the device reflecting lines or not. Device
+ * is switched as the first of them is transmitted
+ */
+void fl2000_stream_set_mirror(struct fl2000_stream *stream, bool mirror)
 {
-	BUG_ON(list_empty(&stream->transmit_list));
+	stream->mirror = mirror;
+}
 
-	sema_init(&stream->work_sem, 0);
-	stream->enabled = true;
-	queue_work(stream->work_queue, &stream->work);
+int fl2000_stream_mode_set(struct fl2000_stream *stream, unsigned int width, unsigned int height,
+			   u32 bytes_pix)
+{
+	int ret;
+	unsigned int size;
 
-	/* Kick transmit workqueue with minimum buffers submitted */
-	for (int i = 0; i < FL2000_SB_MIN; i++)
-		up(&stream->work_sem);
+	/* Round buffer size up to multiple of 8 to meet HW expectations */
+	size = (width * height * bytes_pix + 7) & ~7U;
+
+	stream->bytes_pix = bytes_pix;
+	stream->width = width;
+	stream->height = height;
+
+	/* Device is reset on mode set, it does not reflect lines anymore */
+	stream->tx_mirror = false;
+	atomic_set(&stream->mirror_pending, 0);
+
+	/* Contents of existing buffers are not valid anymore */
+	stream->newest = NULL;
+	stream->frame = 0;
+	fl2000_stream_put_wrapped(stream);
+	drm_rect_init(&stream->pending, 0, 0, 0, 0);
+	for (int i = 0; i < FL2000_SB_NUM; i++)
+		if (stream->sb[i])
+			stream->sb[i]->frame = 0;
+
+	ret = fl2000_stream_reserve(stream, size);
+	if (ret) {
+		stream->buf_size = 0;
+		return ret;
+	}
+
+	stream->buf_size = size;
 
 	return 0;
 }
 
+int fl2000_stream_enable(struct fl2000_stream *stream)
+{
+	int ret;
+	unsigned long flags;
+
+	/* No buffers if mode set failed. Otherwise the first frame may not be rendered yet, URBs
+	 * then wait for it to be kicked
+	 */
+	if (!stream->buf_size)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&stream->tx_lock, flags);
+	for (int i = 0; i < FL2000_URB_NUM; i++)
+		list_add_tail(&stream->surb[i].idle, &stream->idle);
+	spin_unlock_irqrestore(&stream->tx_lock, flags);
+
+	/* Prime the pipeline with all URBs submitted, completions keep it going */
+	WRITE_ONCE(stream->enabled, true);
+	ret = fl2000_stream_kick(stream);
+	if (ret) {
+		dev_err(&stream->usb_dev->dev, "Data URB error %d", ret);
+		fl2000_stream_disable(stream);
+	}
+
+	return ret;
+}
+
 void fl2000_stream_disable(struct fl2000_stream *stream)
 {
-	struct fl2000_stream_buf *cur_sb;
+	unsigned long flags;
 
-	stream->enabled = false;
+	WRITE_ONCE(stream->enabled, false);
 
-	drain_workqueue(stream->work_queue);
+	/* Completions stop resubmitting once they see the stream disabled. Work may still submit
+	 * until it is cancelled, and may be queued again by completions until they all finish
+	 */
+	cancel_work_sync(&stream->work);
 
 	if (!usb_wait_anchor_empty_timeout(&stream->anchor, 1000))
 		usb_kill_anchored_urbs(&stream->anchor);
 
-	spin_lock_irq(&stream->list_lock);
-	while (!list_empty(&stream->transmit_list)) {
-		cur_sb = list_first_entry(&stream->transmit_list, struct fl2000_stream_buf, list);
-		list_move_tail(&cur_sb->list, &stream->render_list);
-	}
-	while (!list_empty(&stream->wait_list)) {
-		cur_sb = list_first_entry(&stream->wait_list, struct fl2000_stream_buf, list);
-		list_move_tail(&cur_sb->list, &stream->render_list);
-	}
-	spin_unlock(&stream->list_lock);
+	cancel_work_sync(&stream->work);
+
+	/* Mirror switch the work did not get to still follows the last transmitted frame */
+	if (atomic_xchg(&stream->mirror_pending, 0))
+		fl2000_set_mirror(stream->usb_dev, stream->tx_mirror);
+
+	/* Frame that was being transmitted is abandoned */
+	spin_lock_irqsave(&stream->tx_lock, flags);
+	if (stream->tx_sb)
+		fl2000_sb_put(stream, stream->tx_sb);
+	stream->tx_sb = NULL;
+	INIT_LIST_HEAD(&stream->idle);
+	spin_unlock_irqrestore(&stream->tx_lock, flags);
+
+	/* Frames that were not transmitted are dropped */
+	for (int i = 0; i < FL2000_SB_NUM; i++)
+		if (stream->sb[i])
+			fl2000_sb_move(stream->sb[i], FL2000_SB_READY, FL2000_SB_FREE);
+	for (int i = 0; i < FL2000_XB_NUM; i++)
+		if (stream->xb[i])
+			fl2000_sb_move(stream->xb[i], FL2000_SB_READY, FL2000_SB_FREE);
 }
 
 /**
@@ -367,8 +1482,8 @@ void fl2000_stream_disable(struct fl2000_stream *stream)
  *
  * This function is called only on Streaming interface probe
  *
- * It shall not initiate any USB transfers. URB is not allocated here because we do not know the
- * stream requirements yet.
+ * It shall not initiate any USB transfers. URBs are not allocated here because we do not know the
+ * stream requirements yet: URBs are allocated together with stream buffers when mode is set.
  *
  * Return: Operation result
  */
@@ -392,15 +1507,29 @@ struct fl2000_stream *fl2000_stream_create(struct usb_device *usb_dev, struct dr
 	devres_add(&usb_dev->dev, stream);
 
 	INIT_WORK(&stream->work, &fl2000_stream_work);
-	INIT_LIST_HEAD(&stream->render_list);
-	INIT_LIST_HEAD(&stream->transmit_list);
-	INIT_LIST_HEAD(&stream->wait_list);
-	spin_lock_init(&stream->list_lock);
+	init_waitqueue_head(&stream->free_wq);
 	init_usb_anchor(&stream->anchor);
-	sema_init(&stream->work_sem, 0);
+	spin_lock_init(&stream->tx_lock);
+	INIT_LIST_HEAD(&stream->idle);
+	init_waitqueue_head(&stream->job.wq);
+	for (int i = 0; i < FL2000_CONV_WORKERS; i++) {
+		INIT_WORK(&stream->conv_worker[i].work, &fl2000_conv_work);
+		stream->conv_worker[i].stream = stream;
+	}
 	stream->usb_dev = usb_dev;
 	stream->crtc = crtc;
 
+	/* Stream buffers are mapped for host controller once, if it does DMA at all */
+	if (hcd_uses_dma(bus_to_hcd(usb_dev->bus)))
+		stream->dma_dev = usb_dev->bus->sysdev;
+
+	/* Place stream buffers close to host controller, and below its DMA mask unless IOMMU
+	 * makes whole memory reachable
+	 */
+	stream->node = dev_to_node(stream->dma_dev ?: &usb_dev->dev);
+	if (stream->dma_dev && dma_addressing_limited(stream->dma_dev))
+		stream->gfp_zone = GFP_DMA32;
+
 	stream->work_queue = create_workqueue("fl2000_stream");
 	if (!stream->work_queue) {
 		dev_err(&usb_dev->dev, "Allocate streaming workqueue failed");
@@ -408,9 +1537,25 @@ struct fl2000_stream *fl2000_stream_create(struct usb_device *usb_dev, struct dr
 		return ERR_PTR(-ENOMEM);
 	}
 
+	/* Bounded pool of conversion workers, not tied to any CPU */
+	stream->conv_wq = alloc_workqueue("fl2000_conv", WQ_UNBOUND | WQ_HIGHPRI,
+					  FL2000_CONV_WORKERS);
+	if (!stream->conv_wq) {
+		dev_err(&usb_dev->dev, "Allocate conversion workqueue failed");
+		devres_release(&usb_dev->dev, fl2000_stream_release, NULL, NULL);
+		return ERR_PTR(-ENOMEM);
+	}
+
 	return stream;
 }
 
+void fl2000_stream_debugfs_init(struct fl2000_stream *stream, struct dentry *root)
+{
+	debugfs_create_atomic_t("fl2000_bounced_buffers", 0444, root, &stream->bounced);
+	debugfs_create_atomic_t("fl2000_dropped_frames", 0444, root, &stream->dropped);
+	debugfs_create_atomic_t("fl2000_superseded_frames", 0444, root, &stream->superseded);
+}
+
 void fl2000_stream_destroy(struct usb_device *usb_dev)
 {
 	devres_release(&usb_dev->dev, fl2000_stream_release, NULL, NULL);